@@ -5,6 +5,8 @@
 #ifndef COMMON_CHECK_H_
 #define COMMON_CHECK_H_
 
+#include <cassert>
+
 #define CHECK(x) assert(x)
 
 #define CHECK_EQ(a, b) CHECK_IMPL(a, b, ==)
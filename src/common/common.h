@@ -9,6 +9,7 @@
 #include "constant.h"
 #include "geometry.h"
 #include "stringprint.h"
+#include "transform.h"
 #include "utility.h"
 #include "color.h"
 
@@ -22,6 +22,12 @@ typedef float Float;
 #define LowestFloat std::numeric_limits<Float>::lowest()
 #define Infinity std::numeric_limits<Float>::infinity()
 
+#ifdef FLOAT_AS_DOUBLE
+static const Float OneMinusEpsilon = 0.99999999999999989;  // 1 - 2^-53
+#else
+static const Float OneMinusEpsilon = 0.99999994f;  // 1 - 2^-24
+#endif
+
 static const Float Pi = 3.14159265358979323846;
 static const Float InvPi = 0.31830988618379067154;
 static const Float Inv2Pi = 0.15915494309189533577;
@@ -15,6 +15,10 @@
 #include "stringprint.h"
 #include "utility.h"
 
+#ifdef FORKER_SIMD_VECTOR3
+#include "simd.h"
+#endif
+
 template <typename T>
 inline bool isNaN(const T x)
 {
@@ -479,6 +483,65 @@ inline Vector3<T> Max(const Vector3<T>& p1, const Vector3<T>& p2)
     return Vector3<T>(std::max(p1.x, p2.x), std::max(p1.y, p2.y), std::max(p1.z, p2.z));
 }
 
+// SIMD Backend
+// With FORKER_SIMD_VECTOR3 (cmake -DFORKER_USE_SIMD_VECTOR3=ON) Dot(), Cross(), Min()
+// and Max() of float vectors run on SSE registers. Vectors are still stored as three
+// floats, so bounds, BVH nodes and mesh buffers keep their layout; the other operators
+// are single instructions that would not pay for the load and store. Results are the
+// same as the scalar code except for Cross(), which stays in float instead of going
+// through double.
+#if defined(FORKER_SIMD_VECTOR3) && defined(FORKER_SIMD_SSE)
+
+inline __m128 LoadVector3(const Vector3<float>& v)
+{
+    return _mm_setr_ps(v.x, v.y, v.z, 0.f);
+}
+
+inline Vector3<float> StoreVector3(__m128 m)
+{
+    return Vector3<float>(_mm_cvtss_f32(m),
+                          _mm_cvtss_f32(_mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1))),
+                          _mm_cvtss_f32(_mm_movehl_ps(m, m)));
+}
+
+// (x + y) + z, in the same order as the scalar code
+template <>
+inline Float Dot(const Vector3<float>& v1, const Vector3<float>& v2)
+{
+    DCHECK(!v1.HasNaNs() && !v2.HasNaNs());
+    __m128 m = _mm_mul_ps(LoadVector3(v1), LoadVector3(v2));
+    __m128 sum = _mm_add_ss(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(_mm_add_ss(sum, _mm_movehl_ps(m, m)));
+}
+
+template <>
+inline Vector3<float> Cross(const Vector3<float>& v1, const Vector3<float>& v2)
+{
+    DCHECK(!v1.HasNaNs() && !v2.HasNaNs());
+    __m128 a = LoadVector3(v1);
+    __m128 b = LoadVector3(v2);
+    __m128 aYZX = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 bYZX = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 aZXY = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 1, 0, 2));
+    __m128 bZXY = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 1, 0, 2));
+    return StoreVector3(_mm_sub_ps(_mm_mul_ps(aYZX, bZXY), _mm_mul_ps(aZXY, bYZX)));
+}
+
+// std::min(a, b) is (b < a) ? b : a, which is _mm_min_ps(b, a) also for NaNs and zeros
+template <>
+inline Vector3<float> Min(const Vector3<float>& p1, const Vector3<float>& p2)
+{
+    return StoreVector3(_mm_min_ps(LoadVector3(p2), LoadVector3(p1)));
+}
+
+template <>
+inline Vector3<float> Max(const Vector3<float>& p1, const Vector3<float>& p2)
+{
+    return StoreVector3(_mm_max_ps(LoadVector3(p2), LoadVector3(p1)));
+}
+
+#endif  // FORKER_SIMD_VECTOR3
+
 template <typename T>
 inline Vector3<T> Lerp(Float t, const Vector3<T>& v1, const Vector3<T>& v2)
 {
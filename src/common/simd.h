@@ -0,0 +1,51 @@
+//
+// Created by Junhao Wang (@Forkercat) on 2021/5/24.
+//
+
+#ifndef SRC_COMMON_SIMD_H_
+#define SRC_COMMON_SIMD_H_
+
+#include "constant.h"
+
+// SIMD Support
+// FORKER_SIMD_SSE  : 4-wide float ops (every x86-64 compiler has SSE2)
+// FORKER_SIMD_AVX  : 8-wide float ops (build with -DFORKER_USE_AVX2=ON)
+// FORKER_SIMD_VECTOR3 : Vector3f Dot/Cross/Min/Max in SSE registers, see geometry.h
+//                       (build with -DFORKER_USE_SIMD_VECTOR3=ON)
+//
+// Kernels fall back to scalar loops when these are not defined, which is always
+// the case with FLOAT_AS_DOUBLE.
+
+#ifndef FLOAT_AS_DOUBLE
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FORKER_SIMD_SSE
+#endif
+
+#if defined(FORKER_SIMD_SSE) && defined(__AVX__)
+#define FORKER_SIMD_AVX
+#endif
+
+#endif  // FLOAT_AS_DOUBLE
+
+#if defined(FORKER_SIMD_AVX)
+#include <immintrin.h>
+#elif defined(FORKER_SIMD_SSE)
+#include <emmintrin.h>
+#endif
+
+// Prefetch
+// FORKER_PREFETCH(address) hints that the cache line at address is needed soon
+#define FORKER_CACHE_LINE_SIZE 64
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define FORKER_PREFETCH(address) \
+    _mm_prefetch(reinterpret_cast<const char*>(address), _MM_HINT_T0)
+#elif defined(__GNUC__)
+#define FORKER_PREFETCH(address) __builtin_prefetch(address)
+#else
+#define FORKER_PREFETCH(address) ((void)0)
+#endif
+
+#endif  // SRC_COMMON_SIMD_H_
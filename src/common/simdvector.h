@@ -0,0 +1,340 @@
+//
+// Created by Junhao Wang (@Forkercat) on 2021/5/29.
+//
+
+#ifndef SRC_COMMON_SIMDVECTOR_H_
+#define SRC_COMMON_SIMDVECTOR_H_
+
+#include <cstdint>
+
+#include "geometry.h"
+#include "simd.h"
+
+// SIMD Vectors
+// FloatN<N> is N floats that are processed together: in an SSE register for N = 4, in
+// an AVX register for N = 8 and in a plain array otherwise. Vec3xN<N> is N vectors in
+// SoA layout (e.g. an edge of N triangles), so that a kernel handles all of them in
+// one pass. Each lane gives the same bits as the Vector3f code it stands for, unless
+// the compiler fuses that scalar code into FMAs (-mfma without -ffp-contract=off).
+// Comparisons return a bit mask of lanes: bit i refers to lane i.
+
+// Lanes (scalar fallback)
+template <int N>
+struct FloatN
+{
+    FloatN() = default;
+    explicit FloatN(Float f)
+    {
+        for (int i = 0; i < N; ++i) v[i] = f;
+    }
+
+    static FloatN Load(const Float* p)
+    {
+        FloatN r;
+        for (int i = 0; i < N; ++i) r.v[i] = p[i];
+        return r;
+    }
+
+    void Store(Float* p) const
+    {
+        for (int i = 0; i < N; ++i) p[i] = v[i];
+    }
+
+    Float operator[](int i) const { return v[i]; }
+
+    // Public Data
+    Float v[N];
+};
+
+// Builds a FloatN from f(i) for every lane i
+template <int N, typename F>
+inline FloatN<N> MakeLanes(F f)
+{
+    FloatN<N> r;
+    for (int i = 0; i < N; ++i) r.v[i] = f(i);
+    return r;
+}
+
+// Mask of the lanes i for which f(i) holds
+template <int N, typename F>
+inline uint32_t MakeLaneMask(F f)
+{
+    uint32_t mask = 0;
+    for (int i = 0; i < N; ++i) mask |= static_cast<uint32_t>(f(i)) << i;
+    return mask;
+}
+
+template <int N>
+inline FloatN<N> operator+(const FloatN<N>& a, const FloatN<N>& b)
+{
+    return MakeLanes<N>([&](int i) { return a.v[i] + b.v[i]; });
+}
+
+template <int N>
+inline FloatN<N> operator-(const FloatN<N>& a, const FloatN<N>& b)
+{
+    return MakeLanes<N>([&](int i) { return a.v[i] - b.v[i]; });
+}
+
+template <int N>
+inline FloatN<N> operator*(const FloatN<N>& a, const FloatN<N>& b)
+{
+    return MakeLanes<N>([&](int i) { return a.v[i] * b.v[i]; });
+}
+
+template <int N>
+inline FloatN<N> operator/(const FloatN<N>& a, const FloatN<N>& b)
+{
+    return MakeLanes<N>([&](int i) { return a.v[i] / b.v[i]; });
+}
+
+template <int N>
+inline FloatN<N> Abs(const FloatN<N>& a)
+{
+    return MakeLanes<N>([&](int i) { return std::abs(a.v[i]); });
+}
+
+// Same as std::min() and std::max() per lane
+template <int N>
+inline FloatN<N> Min(const FloatN<N>& a, const FloatN<N>& b)
+{
+    return MakeLanes<N>([&](int i) { return std::min(a.v[i], b.v[i]); });
+}
+
+template <int N>
+inline FloatN<N> Max(const FloatN<N>& a, const FloatN<N>& b)
+{
+    return MakeLanes<N>([&](int i) { return std::max(a.v[i], b.v[i]); });
+}
+
+// a * b - c * d, in the precision that Cross() uses
+template <int N>
+inline FloatN<N> DiffOfProducts(const FloatN<N>& a, const FloatN<N>& b,
+                                const FloatN<N>& c, const FloatN<N>& d)
+{
+#ifdef FORKER_SIMD_VECTOR3
+    return MakeLanes<N>([&](int i) { return a.v[i] * b.v[i] - c.v[i] * d.v[i]; });
+#else
+    return MakeLanes<N>([&](int i) {
+        return static_cast<Float>(static_cast<double>(a.v[i]) * b.v[i] -
+                                  static_cast<double>(c.v[i]) * d.v[i]);
+    });
+#endif
+}
+
+template <int N>
+inline uint32_t LessMask(const FloatN<N>& a, const FloatN<N>& b)
+{
+    return MakeLaneMask<N>([&](int i) { return a.v[i] < b.v[i]; });
+}
+
+template <int N>
+inline uint32_t LessEqualMask(const FloatN<N>& a, const FloatN<N>& b)
+{
+    return MakeLaneMask<N>([&](int i) { return a.v[i] <= b.v[i]; });
+}
+
+template <int N>
+inline uint32_t GreaterMask(const FloatN<N>& a, const FloatN<N>& b)
+{
+    return MakeLaneMask<N>([&](int i) { return a.v[i] > b.v[i]; });
+}
+
+#ifdef FORKER_SIMD_SSE
+// Lanes (SSE)
+template <>
+struct FloatN<4>
+{
+    FloatN() = default;
+    FloatN(__m128 m) : m(m) { }
+    explicit FloatN(Float f) : m(_mm_set1_ps(f)) { }
+
+    static FloatN Load(const Float* p) { return _mm_loadu_ps(p); }
+    void          Store(Float* p) const { _mm_storeu_ps(p, m); }
+
+    Float operator[](int i) const
+    {
+        alignas(16) float v[4];
+        _mm_store_ps(v, m);
+        return v[i];
+    }
+
+    // Public Data
+    __m128 m;
+};
+
+inline FloatN<4> operator+(FloatN<4> a, FloatN<4> b) { return _mm_add_ps(a.m, b.m); }
+inline FloatN<4> operator-(FloatN<4> a, FloatN<4> b) { return _mm_sub_ps(a.m, b.m); }
+inline FloatN<4> operator*(FloatN<4> a, FloatN<4> b) { return _mm_mul_ps(a.m, b.m); }
+inline FloatN<4> operator/(FloatN<4> a, FloatN<4> b) { return _mm_div_ps(a.m, b.m); }
+
+inline FloatN<4> Abs(FloatN<4> a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a.m); }
+
+// std::min(a, b) is (b < a) ? b : a, which is _mm_min_ps(b, a) also for NaNs and zeros
+inline FloatN<4> Min(FloatN<4> a, FloatN<4> b) { return _mm_min_ps(b.m, a.m); }
+inline FloatN<4> Max(FloatN<4> a, FloatN<4> b) { return _mm_max_ps(b.m, a.m); }
+
+inline FloatN<4> DiffOfProducts(FloatN<4> a, FloatN<4> b, FloatN<4> c, FloatN<4> d)
+{
+#ifdef FORKER_SIMD_VECTOR3
+    return _mm_sub_ps(_mm_mul_ps(a.m, b.m), _mm_mul_ps(c.m, d.m));
+#else
+    __m128d lo = _mm_sub_pd(_mm_mul_pd(_mm_cvtps_pd(a.m), _mm_cvtps_pd(b.m)),
+                            _mm_mul_pd(_mm_cvtps_pd(c.m), _mm_cvtps_pd(d.m)));
+    __m128d hi = _mm_sub_pd(_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(a.m, a.m)),
+                                       _mm_cvtps_pd(_mm_movehl_ps(b.m, b.m))),
+                            _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(c.m, c.m)),
+                                       _mm_cvtps_pd(_mm_movehl_ps(d.m, d.m))));
+    return _mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi));
+#endif
+}
+
+inline uint32_t LessMask(FloatN<4> a, FloatN<4> b)
+{
+    return static_cast<uint32_t>(_mm_movemask_ps(_mm_cmplt_ps(a.m, b.m)));
+}
+
+inline uint32_t LessEqualMask(FloatN<4> a, FloatN<4> b)
+{
+    return static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(a.m, b.m)));
+}
+
+inline uint32_t GreaterMask(FloatN<4> a, FloatN<4> b)
+{
+    return static_cast<uint32_t>(_mm_movemask_ps(_mm_cmpgt_ps(a.m, b.m)));
+}
+#endif  // FORKER_SIMD_SSE
+
+#ifdef FORKER_SIMD_AVX
+// Lanes (AVX)
+template <>
+struct FloatN<8>
+{
+    FloatN() = default;
+    FloatN(__m256 m) : m(m) { }
+    explicit FloatN(Float f) : m(_mm256_set1_ps(f)) { }
+
+    static FloatN Load(const Float* p) { return _mm256_loadu_ps(p); }
+    void          Store(Float* p) const { _mm256_storeu_ps(p, m); }
+
+    Float operator[](int i) const
+    {
+        alignas(32) float v[8];
+        _mm256_store_ps(v, m);
+        return v[i];
+    }
+
+    // Public Data
+    __m256 m;
+};
+
+inline FloatN<8> operator+(FloatN<8> a, FloatN<8> b) { return _mm256_add_ps(a.m, b.m); }
+inline FloatN<8> operator-(FloatN<8> a, FloatN<8> b) { return _mm256_sub_ps(a.m, b.m); }
+inline FloatN<8> operator*(FloatN<8> a, FloatN<8> b) { return _mm256_mul_ps(a.m, b.m); }
+inline FloatN<8> operator/(FloatN<8> a, FloatN<8> b) { return _mm256_div_ps(a.m, b.m); }
+
+inline FloatN<8> Abs(FloatN<8> a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a.m); }
+
+inline FloatN<8> Min(FloatN<8> a, FloatN<8> b) { return _mm256_min_ps(b.m, a.m); }
+inline FloatN<8> Max(FloatN<8> a, FloatN<8> b) { return _mm256_max_ps(b.m, a.m); }
+
+inline FloatN<8> DiffOfProducts(FloatN<8> a, FloatN<8> b, FloatN<8> c, FloatN<8> d)
+{
+#ifdef FORKER_SIMD_VECTOR3
+    return _mm256_sub_ps(_mm256_mul_ps(a.m, b.m), _mm256_mul_ps(c.m, d.m));
+#else
+    // Four lanes at a time in double
+    auto half = [&](int i) {
+        __m256d ad = _mm256_cvtps_pd(i ? _mm256_extractf128_ps(a.m, 1)
+                                       : _mm256_castps256_ps128(a.m));
+        __m256d bd = _mm256_cvtps_pd(i ? _mm256_extractf128_ps(b.m, 1)
+                                       : _mm256_castps256_ps128(b.m));
+        __m256d cd = _mm256_cvtps_pd(i ? _mm256_extractf128_ps(c.m, 1)
+                                       : _mm256_castps256_ps128(c.m));
+        __m256d dd = _mm256_cvtps_pd(i ? _mm256_extractf128_ps(d.m, 1)
+                                       : _mm256_castps256_ps128(d.m));
+        return _mm256_cvtpd_ps(_mm256_sub_pd(_mm256_mul_pd(ad, bd), _mm256_mul_pd(cd, dd)));
+    };
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(half(0)), half(1), 1);
+#endif
+}
+
+inline uint32_t LessMask(FloatN<8> a, FloatN<8> b)
+{
+    return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(a.m, b.m, _CMP_LT_OQ)));
+}
+
+inline uint32_t LessEqualMask(FloatN<8> a, FloatN<8> b)
+{
+    return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(a.m, b.m, _CMP_LE_OQ)));
+}
+
+inline uint32_t GreaterMask(FloatN<8> a, FloatN<8> b)
+{
+    return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(a.m, b.m, _CMP_GT_OQ)));
+}
+#endif  // FORKER_SIMD_AVX
+
+// SoA Vectors
+template <int N>
+struct Vec3xN
+{
+    Vec3xN() = default;
+    Vec3xN(const FloatN<N>& x, const FloatN<N>& y, const FloatN<N>& z) : x(x), y(y), z(z)
+    {
+    }
+    // v in every lane
+    explicit Vec3xN(const Vector3f& v) : x(v.x), y(v.y), z(v.z) { }
+
+    // Lane i is (xs[i], ys[i], zs[i])
+    static Vec3xN Load(const Float* xs, const Float* ys, const Float* zs)
+    {
+        return Vec3xN(FloatN<N>::Load(xs), FloatN<N>::Load(ys), FloatN<N>::Load(zs));
+    }
+
+    Vector3f operator[](int i) const { return Vector3f(x[i], y[i], z[i]); }
+
+    // Public Data
+    FloatN<N> x, y, z;
+};
+
+template <int N>
+inline Vec3xN<N> operator+(const Vec3xN<N>& a, const Vec3xN<N>& b)
+{
+    return Vec3xN<N>(a.x + b.x, a.y + b.y, a.z + b.z);
+}
+
+template <int N>
+inline Vec3xN<N> operator-(const Vec3xN<N>& a, const Vec3xN<N>& b)
+{
+    return Vec3xN<N>(a.x - b.x, a.y - b.y, a.z - b.z);
+}
+
+template <int N>
+inline Vec3xN<N> operator*(const Vec3xN<N>& a, const FloatN<N>& f)
+{
+    return Vec3xN<N>(a.x * f, a.y * f, a.z * f);
+}
+
+// (x + y) + z, in the same order as Dot(Vector3f, Vector3f)
+template <int N>
+inline FloatN<N> Dot(const Vec3xN<N>& a, const Vec3xN<N>& b)
+{
+    return (a.x * b.x + a.y * b.y) + a.z * b.z;
+}
+
+template <int N>
+inline Vec3xN<N> Cross(const Vec3xN<N>& a, const Vec3xN<N>& b)
+{
+    return Vec3xN<N>(DiffOfProducts(a.y, b.z, a.z, b.y), DiffOfProducts(a.z, b.x, a.x, b.z),
+                     DiffOfProducts(a.x, b.y, a.y, b.x));
+}
+
+// Typedef
+
+typedef FloatN<4> Float4;
+typedef FloatN<8> Float8;
+typedef Vec3xN<4> Vec3x4;
+typedef Vec3xN<8> Vec3x8;
+
+#endif  // SRC_COMMON_SIMDVECTOR_H_
@@ -0,0 +1,154 @@
+//
+// Created by Junhao Wang (@Forkercat) on 2021/5/26.
+//
+
+#ifndef SRC_COMMON_TRANSFORM_H_
+#define SRC_COMMON_TRANSFORM_H_
+
+#include <cmath>
+
+#include "geometry.h"
+#include "utility.h"
+
+// AffineTransform: 3x4 matrix (linear part + translation) together with its inverse,
+// so normals and inverse mappings need no extra work
+class AffineTransform
+{
+public:
+    // Constructors
+    AffineTransform() : AffineTransform(Identity(), Identity()) { }
+
+    // Scale, then rotate around X, Y and Z (in degrees), then translate; the order
+    // that ApplyTransform() uses
+    static AffineTransform FromTRS(const Vector3f& translate, const Vector3f& rotate,
+                                   Float scale);
+
+    static AffineTransform Translate(const Vector3f& t);
+    static AffineTransform Scale(Float s);
+    static AffineTransform Rotate(int axis, Float degrees);
+
+    AffineTransform operator*(const AffineTransform& t) const
+    {
+        return AffineTransform(multiply(m_M, t.m_M), multiply(t.m_Inv, m_Inv));
+    }
+
+    AffineTransform Inverse() const { return AffineTransform(m_Inv, m_M); }
+
+    // Determinant of the linear part: the factor by which volumes scale
+    Float Determinant() const
+    {
+        const Float(&m)[4] = m_M.m[0];
+        const Float(&n)[4] = m_M.m[1];
+        const Float(&o)[4] = m_M.m[2];
+        return m[0] * (n[1] * o[2] - n[2] * o[1]) - m[1] * (n[0] * o[2] - n[2] * o[0]) +
+               m[2] * (n[0] * o[1] - n[1] * o[0]);
+    }
+
+    Point3f ApplyPoint(const Point3f& p) const
+    {
+        const Float(&m)[3][4] = m_M.m;
+        return Point3f(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                       m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                       m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+    }
+
+    Vector3f ApplyVector(const Vector3f& v) const
+    {
+        return Vector3f(m_M.m[0][0] * v.x + m_M.m[0][1] * v.y + m_M.m[0][2] * v.z,
+                        m_M.m[1][0] * v.x + m_M.m[1][1] * v.y + m_M.m[1][2] * v.z,
+                        m_M.m[2][0] * v.x + m_M.m[2][1] * v.y + m_M.m[2][2] * v.z);
+    }
+
+    // Normals go through the inverse transpose (not normalized)
+    Vector3f ApplyNormal(const Vector3f& n) const
+    {
+        return Vector3f(m_Inv.m[0][0] * n.x + m_Inv.m[1][0] * n.y + m_Inv.m[2][0] * n.z,
+                        m_Inv.m[0][1] * n.x + m_Inv.m[1][1] * n.y + m_Inv.m[2][1] * n.z,
+                        m_Inv.m[0][2] * n.x + m_Inv.m[1][2] * n.y + m_Inv.m[2][2] * n.z);
+    }
+
+private:
+    struct Matrix3x4
+    {
+        Float m[3][4];
+    };
+
+    AffineTransform(const Matrix3x4& m, const Matrix3x4& inv) : m_M(m), m_Inv(inv) { }
+
+    static Matrix3x4 Identity()
+    {
+        return Matrix3x4{ { { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 } } };
+    }
+
+    // a * b, both with an implicit (0, 0, 0, 1) last row
+    static Matrix3x4 multiply(const Matrix3x4& a, const Matrix3x4& b)
+    {
+        Matrix3x4 r;
+        for (int i = 0; i < 3; ++i)
+        {
+            for (int j = 0; j < 4; ++j)
+            {
+                r.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] +
+                            a.m[i][2] * b.m[2][j] + (j == 3 ? a.m[i][3] : 0.f);
+            }
+        }
+        return r;
+    }
+
+    // Private Data
+    Matrix3x4 m_M;
+    Matrix3x4 m_Inv;
+};
+
+inline AffineTransform AffineTransform::Translate(const Vector3f& t)
+{
+    Matrix3x4 m = Identity();
+    Matrix3x4 inv = Identity();
+    for (int i = 0; i < 3; ++i)
+    {
+        m.m[i][3] = t[i];
+        inv.m[i][3] = -t[i];
+    }
+    return AffineTransform(m, inv);
+}
+
+inline AffineTransform AffineTransform::Scale(Float s)
+{
+    Matrix3x4 m = Identity();
+    Matrix3x4 inv = Identity();
+    for (int i = 0; i < 3; ++i)
+    {
+        m.m[i][i] = s;
+        inv.m[i][i] = 1.f / s;
+    }
+    return AffineTransform(m, inv);
+}
+
+inline AffineTransform AffineTransform::Rotate(int axis, Float degrees)
+{
+    Float sinTheta = std::sin(Radians(degrees));
+    Float cosTheta = std::cos(Radians(degrees));
+
+    // Rotation in the plane of the two other axes; the inverse is the transpose
+    int       a = (axis + 1) % 3;
+    int       b = (axis + 2) % 3;
+    Matrix3x4 m = Identity();
+    m.m[a][a] = cosTheta;
+    m.m[a][b] = -sinTheta;
+    m.m[b][a] = sinTheta;
+    m.m[b][b] = cosTheta;
+
+    Matrix3x4 inv = m;
+    inv.m[a][b] = sinTheta;
+    inv.m[b][a] = -sinTheta;
+    return AffineTransform(m, inv);
+}
+
+inline AffineTransform AffineTransform::FromTRS(const Vector3f& translate,
+                                                const Vector3f& rotate, Float scale)
+{
+    return Translate(translate) * Rotate(2, rotate.z) * Rotate(1, rotate.y) *
+           Rotate(0, rotate.x) * Scale(scale);
+}
+
+#endif  // SRC_COMMON_TRANSFORM_H_
@@ -5,8 +5,9 @@
 #ifndef COMMON_UTILITY_H_
 #define COMMON_UTILITY_H_
 
+#include <algorithm>
+#include <cstdint>
 #include <cstdlib>
-#include <random>
 
 #include "constant.h"
 
@@ -75,14 +76,79 @@ inline T Max3(const T& v1, const T& v2, const T& v3)
     return std::max(v1, std::max(v2, v3));
 }
 
+// Random Number Generator
+
+// PCG32 (https://www.pcg-random.org): 16 bytes of state and a handful of
+// instructions per number. Every thread owns one (see ThreadRNG), and the renderer
+// reseeds it per pixel so that a frame is reproducible regardless of scheduling.
+class RNG
+{
+public:
+    // Constructors
+    RNG() : m_State(DefaultState), m_Inc(DefaultStream) { }
+    RNG(uint64_t sequenceIndex, uint64_t seed) { SetSequence(sequenceIndex, seed); }
+
+    void SetSequence(uint64_t sequenceIndex, uint64_t seed)
+    {
+        m_State = 0u;
+        m_Inc = (sequenceIndex << 1u) | 1u;
+        UniformUInt32();
+        m_State += seed;
+        UniformUInt32();
+    }
+
+    uint32_t UniformUInt32()
+    {
+        uint64_t oldState = m_State;
+        m_State = oldState * Multiplier + m_Inc;
+        uint32_t xorShifted = (uint32_t)(((oldState >> 18u) ^ oldState) >> 27u);
+        uint32_t rot = (uint32_t)(oldState >> 59u);
+        return (xorShifted >> rot) | (xorShifted << ((~rot + 1u) & 31));
+    }
+
+    // Random real in [0, 1)
+    Float Uniform01()
+    {
+        return std::min(OneMinusEpsilon, Float(UniformUInt32() * 2.3283064365386963e-10));
+    }
+
+private:
+    static const uint64_t DefaultState = 0x853c49e6748fea9bULL;
+    static const uint64_t DefaultStream = 0xda3e39cb94b95bdbULL;
+    static const uint64_t Multiplier = 0x5851f42d4c957f2dULL;
+
+    uint64_t m_State;
+    uint64_t m_Inc;
+};
+
+// 64-bit bit mixer, as MixBits() in pbrt-v4 (a MurmurHash3 fmix64-style finalizer
+// with different shifts and constants)
+inline uint64_t MixBits(uint64_t v)
+{
+    v ^= (v >> 31);
+    v *= 0x7fb5d329728ea185ULL;
+    v ^= (v >> 27);
+    v *= 0x81dadef4bc2dd44dULL;
+    v ^= (v >> 33);
+    return v;
+}
+
+inline RNG& ThreadRNG()
+{
+    static thread_local RNG rng;
+    return rng;
+}
+
+inline void SeedRandom(uint64_t sequenceIndex, uint64_t seed)
+{
+    ThreadRNG().SetSequence(sequenceIndex, MixBits(seed));
+}
+
 inline Float Random01()
 {
     // Old
     // return rand() / (RAND_MAX + 1.f);  // random real in [0, 1)
-    // New
-    static std::uniform_real_distribution<Float> distribution(0.f, 1.f);
-    static std::mt19937                          generator;
-    return distribution(generator);
+    return ThreadRNG().Uniform01();
 }
 
 inline Float Random(Float min, Float max)
@@ -27,8 +27,23 @@ public:
     inline Vector3f&       operator[](int i) { return (i == 0) ? pMin : pMax; }
 
     Vector3f Diagonal() const { return pMax - pMin; }
+    bool     IsEmpty() const { return pMin.x > pMax.x || pMin.y > pMax.y || pMin.z > pMax.z; }
     int      MaxExtent() const { return MaxDimension(Diagonal()); }
-    Vector3f Centroid() { return pMin * 0.5 + pMax * 0.5; }
+    Vector3f Centroid() const { return pMin * 0.5 + pMax * 0.5; }
+    Float    SurfaceArea() const
+    {
+        Vector3f d = Diagonal();
+        return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
+    }
+    // Position of p relative to the corners: pMin -> (0, 0, 0), pMax -> (1, 1, 1)
+    Vector3f Offset(const Point3f& p) const
+    {
+        Vector3f o = p - pMin;
+        if (pMax.x > pMin.x) o.x /= pMax.x - pMin.x;
+        if (pMax.y > pMin.y) o.y /= pMax.y - pMin.y;
+        if (pMax.z > pMin.z) o.z /= pMax.z - pMin.z;
+        return o;
+    }
     bool     IntersectP(const Ray& ray, const Vector3f& invDir,
                         const std::array<int, 3>& dirIsNeg, Float tMax) const;
 
@@ -7,158 +7,2005 @@
 #include <spdlog/spdlog.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 
+#include "bvhcache.h"
+#include "nodelayout.h"
 #include "scene.h"
+#include "simd.h"
+#include "threadpool.h"
 #include "triangle.h"
+#include "widebvh.h"
 
-BVHAccel::BVHAccel(const Scene& scene) : BVHAccel(scene.GetObjects())
+namespace
 {
+// Nodes with at least this many objects compute their bounds, SAH bins and
+// partition in parallel chunks
+const int ParallelBuildThreshold = 16 * 1024;
+const int ParallelChunkSize = 4 * 1024;
+
+// Both subtrees need at least this many objects to build them concurrently
+const int ParallelSubtreeThreshold = 1024;
+
+// SBVH: spatial splits are only tried where the children of the best object split
+// overlap by more than this fraction of the root's surface area
+const Float SpatialSplitOverlap = 1e-5f;
+
+// Treelet restructuring: leaves per treelet (2^7 subsets in the search) and nodes per
+// parallel task
+const int MaxTreeletLeaves = 7;
+const int TreeletChunkSize = 16;
+
+const char* SplitMethodName(BVHBuildOptions::SplitMethod splitMethod)
+{
+    switch (splitMethod)
+    {
+    case BVHBuildOptions::Median: return "Median";
+    case BVHBuildOptions::SAH: return "SAH";
+    case BVHBuildOptions::SBVH: return "SBVH";
+    case BVHBuildOptions::LBVH: return "LBVH";
+    }
+    return "Unknown";
 }
 
-BVHAccel::BVHAccel(const MeshTriangle& meshTriangle) : BVHAccel(meshTriangle.GetTriangles())
+int NumChunks(int count, bool parallel)
 {
+    return parallel ? (count + ParallelChunkSize - 1) / ParallelChunkSize : 1;
 }
 
-BVHAccel::BVHAccel(const std::vector<std::shared_ptr<Hittable>>& objects)
-    : m_Objects(objects)
+// Calls func(chunk, begin, end) for every chunk of [0, count)
+template <typename Func>
+void ForEachChunk(int count, int numChunks, const Func& func)
 {
-    time_t start, end;
-    time(&start);
+    if (numChunks == 1)
+    {
+        func(0, 0, count);
+        return;
+    }
 
-    if (objects.empty()) return;
+    ParallelFor(0, numChunks, 1, [&](int chunkBegin, int chunkEnd) {
+        for (int chunk = chunkBegin; chunk < chunkEnd; ++chunk)
+        {
+            int begin = static_cast<int>((int64_t)count * chunk / numChunks);
+            int end = static_cast<int>((int64_t)count * (chunk + 1) / numChunks);
+            func(chunk, begin, end);
+        }
+    });
+}
 
-    m_Root = recursiveBuild(objects);
+// SAH bin of a centroid coordinate, for numBins bins over [minCentroid, minCentroid +
+// extent]
+inline int SAHBin(Float centroid, Float minCentroid, Float extent, int numBins)
+{
+    int index = static_cast<int>(numBins * ((centroid - minCentroid) / extent));
+    return Clamp(index, 0, numBins - 1);
+}
 
-    time(&end);
-    Float diff = difftime(end, start);
-    int hrs = (int)diff / 3600;
-    int mins = ((int)diff / 60) - (hrs * 60);
-    int secs = ((int)diff - (hrs * 3600) - (mins * 60));
+// Spreads the lower 10 bits of x so that there are two zero bits between each
+inline uint32_t LeftShift3(uint32_t x)
+{
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x30000ff;  // x = ---- --98 ---- ---- ---- ---- 7654 3210
+    x = (x | (x << 8)) & 0x300f00f;   // x = ---- --98 ---- ---- 7654 ---- ---- 3210
+    x = (x | (x << 4)) & 0x30c30c3;   // x = ---- --98 ---- 76-- --54 ---- 32-- --10
+    x = (x | (x << 2)) & 0x9249249;   // x = ---- 9--8 --7- -6-- 5--4 --3- -2-- 1--0
+    return x;
+}
 
-    spdlog::info("[BVHAccel] BVH Generation Complete: {} hrs, {} mins, {} secs", hrs, mins, secs);
+// 30-bit Morton code of a point in [0, 1024)^3, x in the highest bit of each triple
+inline uint32_t EncodeMorton3(const Vector3f& v)
+{
+    return (LeftShift3(static_cast<uint32_t>(v.x)) << 2) |
+           (LeftShift3(static_cast<uint32_t>(v.y)) << 1) |
+           LeftShift3(static_cast<uint32_t>(v.z));
 }
 
-// Public Methods
-bool BVHAccel::Hit(const Ray& ray, Float tMin, Float tMax, HitRecord& hitRecord) const
+// Slab test of a box against the active rays of a packet. Returns the mask of rays
+// that enter the box within [0, tMax]. Ties and NaNs count as hits, so no ray is
+// dropped that Bounds3::IntersectP would keep.
+inline uint32_t IntersectBoundsPacket(const Bounds3& bounds, const RayPacket& packet,
+                                      uint32_t activeMask, const Float tMax[])
 {
-    if (m_Root != nullptr)
+    uint32_t mask = 0;
+#ifdef FORKER_SIMD_SSE
+    for (int first = 0; first < packet.size; first += 4)
     {
-        return getHitRecord(m_Root, ray, tMin, tMax, hitRecord);
+        if (!((activeMask >> first) & 0xf)) continue;
+
+        __m128 tNear = _mm_setzero_ps();
+        __m128 tFar = _mm_loadu_ps(tMax + first);
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            __m128 pMin = _mm_set1_ps(bounds.pMin[axis]);
+            __m128 pMax = _mm_set1_ps(bounds.pMax[axis]);
+            __m128 origin = _mm_loadu_ps(packet.origin[axis] + first);
+            __m128 invDir = _mm_loadu_ps(packet.invDir[axis] + first);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(pMin, origin), invDir);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(pMax, origin), invDir);
+
+            // NaNs (0 * inf) keep the running value
+            tNear = _mm_max_ps(_mm_min_ps(t0, t1), tNear);
+            tFar = _mm_min_ps(_mm_max_ps(t0, t1), tFar);
+        }
+        uint32_t hit = static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(tNear, tFar)));
+        mask |= hit << first;
     }
-    return false;
+#else
+    for (int i = 0; i < packet.size; ++i)
+    {
+        Float tNear = 0.f;
+        Float tFar = tMax[i];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            Float origin = packet.origin[axis][i];
+            Float invDir = packet.invDir[axis][i];
+            Float t0 = (bounds.pMin[axis] - origin) * invDir;
+            Float t1 = (bounds.pMax[axis] - origin) * invDir;
+            if (t0 > t1) std::swap(t0, t1);
+            tNear = t0 > tNear ? t0 : tNear;
+            tFar = t1 < tFar ? t1 : tFar;
+        }
+        mask |= static_cast<uint32_t>(tNear <= tFar) << i;
+    }
+#endif
+    return mask & activeMask;
 }
 
-Bounds3 BVHAccel::WorldBound() const
+// Whether the first active ray of a packet goes towards -axis; decides the order in
+// which the packet visits the children of a node
+inline bool FirstDirIsNeg(const RayPacket& packet, uint32_t activeMask, int axis)
 {
-    return (m_Root != nullptr) ? m_Root->bounds : Bounds3();
+    int first = 0;
+    while (!(activeMask & (1u << first))) ++first;
+    return packet.dir[axis][first] < 0;
 }
+}  // namespace
 
-// Private Methods
+// Primitives of a subtree under construction with their bounds. Spatial splits clip
+// the bounds and may add the same primitive to several subtrees.
+struct BVHBuildRefs
+{
+    int            Size() const { return static_cast<int>(primitives.size()); }
+    const Bounds3& Bounds(int i) const { return bounds[i]; }
+    Point3f        Centroid(int i) const { return bounds[i].Centroid(); }
 
-bool BVHAccel::getHitRecord(std::shared_ptr<BVHNode> node, const Ray& ray, Float tMin,
-    Float tMax, HitRecord& hitRecord) const
+    std::vector<int32_t> primitives;
+    std::vector<Bounds3> bounds;
+};
+
+// Objects of a Median, SAH or LBVH build. Their bounds and centroids are computed
+// once; every subtree owns a range of the index array and partitions it in place.
+// In the end the indices are in leaf order.
+struct BVHBuildPrims
 {
-    std::array<int, 3> dirIsNeg = { ray.dir.x < 0, ray.dir.y < 0, ray.dir.z < 0 };
+    explicit BVHBuildPrims(const PrimitiveSet& primitives)
+        : bounds(primitives.NumPrimitives()),
+          centroids(primitives.NumPrimitives()),
+          indices(primitives.NumPrimitives()),
+          scratch(),
+          numNodes(1)
+    {
+        ParallelFor(0, primitives.NumPrimitives(), ParallelChunkSize,
+                    [&](int begin, int end) {
+                        for (int i = begin; i < end; ++i)
+                        {
+                            bounds[i] = primitives.PrimitiveBound(i);
+                            centroids[i] = bounds[i].Centroid();
+                            indices[i] = i;
+                        }
+                    });
+    }
 
-    // Current Node
-    if (!node->bounds.IntersectP(ray, ray.invDir, dirIsNeg, tMax))
+    std::vector<Bounds3> bounds;
+    std::vector<Point3f> centroids;
+    std::vector<int32_t> indices;
+    std::vector<int32_t> scratch;   // partition buffer, same size as indices
+    std::atomic<int>     numNodes;  // nodes handed out so far, the root included
+};
+
+// Objects [begin, end) of a BVHBuildPrims
+struct BVHBuildRange
+{
+    int            Size() const { return end - begin; }
+    const Bounds3& Bounds(int i) const { return prims.bounds[prims.indices[begin + i]]; }
+    const Point3f& Centroid(int i) const
     {
-        return false;
+        return prims.centroids[prims.indices[begin + i]];
+    }
+
+    const BVHBuildPrims& prims;
+    int                  begin;
+    int                  end;
+};
+
+// Binned SAH split plane: objects whose centroid falls into bins [0, bin] go left
+struct SAHSplit
+{
+    bool GoesLeft(const Point3f& centroid) const
+    {
+        return SAHBin(centroid[axis], minCentroid, extent, numBins) <= bin;
     }
 
-    // Check if current node is a leaf node
-    if (node->object != nullptr)
+    int   axis;
+    int   bin;
+    int   numBins;
+    Float minCentroid;
+    Float extent;
+    Float cost;
+};
+
+// SBVH split plane
+struct SpatialSplit
+{
+    int   axis;
+    Float position;
+    Float cost;
+};
+
+// Per-node data of the treelet optimizer, for the subtree below each node
+struct TreeletCosts
+{
+    std::vector<Float> cost;  // area-weighted SAH cost, with cheaper leaves collapsed
+    std::vector<int>   height;
+    std::vector<int>   numPrimitives;
+};
+
+// Morton Primitive
+struct MortonPrimitive
+{
+    int      primitiveIndex;
+    uint32_t mortonCode;
+};
+
+namespace
+{
+// LSD radix sort on the Morton codes. Every pass histograms and scatters chunks of
+// the array in parallel; the scatter keeps each chunk's order, so the sort is stable.
+void RadixSort(std::vector<MortonPrimitive>& v)
+{
+    const int bitsPerPass = 10;
+    const int numBuckets = 1 << bitsPerPass;
+    const int bitMask = numBuckets - 1;
+    const int numPasses = 30 / bitsPerPass;
+
+    const int numPrims = static_cast<int>(v.size());
+    const int numChunks = NumChunks(numPrims, numPrims >= ParallelBuildThreshold);
+
+    std::vector<MortonPrimitive> tempVector(v.size());
+    std::vector<int>             chunkCounts(numChunks * numBuckets);
+
+    for (int pass = 0; pass < numPasses; ++pass)
     {
-        return node->object->Hit(ray, tMin, tMax, hitRecord);
+        int lowBit = pass * bitsPerPass;
+
+        // Ping-pong between the two arrays, so v holds the result after an odd pass
+        std::vector<MortonPrimitive>& in = (pass & 1) ? tempVector : v;
+        std::vector<MortonPrimitive>& out = (pass & 1) ? v : tempVector;
+
+        std::fill(chunkCounts.begin(), chunkCounts.end(), 0);
+        ForEachChunk(numPrims, numChunks, [&](int chunk, int begin, int end) {
+            int* counts = &chunkCounts[chunk * numBuckets];
+            for (int i = begin; i < end; ++i)
+            {
+                ++counts[(in[i].mortonCode >> lowBit) & bitMask];
+            }
+        });
+
+        // Exclusive scan in bucket-major order turns counts into output offsets
+        int offset = 0;
+        for (int bucket = 0; bucket < numBuckets; ++bucket)
+        {
+            for (int chunk = 0; chunk < numChunks; ++chunk)
+            {
+                int count = chunkCounts[chunk * numBuckets + bucket];
+                chunkCounts[chunk * numBuckets + bucket] = offset;
+                offset += count;
+            }
+        }
+
+        ForEachChunk(numPrims, numChunks, [&](int chunk, int begin, int end) {
+            int* offsets = &chunkCounts[chunk * numBuckets];
+            for (int i = begin; i < end; ++i)
+            {
+                out[offsets[(in[i].mortonCode >> lowBit) & bitMask]++] = in[i];
+            }
+        });
     }
 
-    // Children Nodes
-    HitRecord leftHitRecord;
-    HitRecord rightHitRecord;
-    bool hitLeft = getHitRecord(node->left, ray, tMin, tMax, leftHitRecord);
-    bool hitRight = getHitRecord(node->right, ray, tMin, tMax, rightHitRecord);
+    if (numPasses & 1) std::swap(v, tempVector);
+}
+}  // namespace
+
+BVHAccel::BVHAccel(const Scene& scene, const BVHBuildOptions& options)
+    : BVHAccel(scene.GetObjects(), options)
+{
+}
 
-    // Get the closest time
-    if (hitLeft)
+BVHAccel::BVHAccel(const MeshTriangle& meshTriangle, const BVHBuildOptions& options)
+    : BVHAccel(options)
+{
+    m_Primitives = &meshTriangle;
+    if (m_Options.cacheDir.empty())
     {
-        hitRecord = leftHitRecord;
+        build();
+        return;
     }
 
-    if (hitRight && rightHitRecord.t < hitRecord.t)
+    BVHCache cache(m_Options.cacheDir, meshTriangle, m_Options);
+    if (!loadCache(cache))
     {
-        hitRecord = rightHitRecord;
+        build();
+        saveCache(cache);
     }
+}
 
-    return hitLeft || hitRight;
+BVHAccel::BVHAccel(const std::vector<std::shared_ptr<Hittable>>& objects,
+                   const BVHBuildOptions&                        options)
+    : BVHAccel(options)
+{
+    m_OwnedPrimitives = std::make_unique<HittablePrimitives>(objects);
+    m_Primitives = m_OwnedPrimitives.get();
+    build();
 }
 
-std::shared_ptr<BVHNode> BVHAccel::recursiveBuild(
-    std::vector<std::shared_ptr<Hittable>> objects)
+BVHAccel::BVHAccel(const PrimitiveSet& primitives, const BVHBuildOptions& options)
+    : BVHAccel(options)
 {
-    std::shared_ptr<BVHNode> node = std::make_shared<BVHNode>();
+    m_Primitives = &primitives;
+    build();
+}
 
-    if (objects.size() == 1)
+BVHAccel::BVHAccel(const BVHBuildOptions& options)
+    : m_Options(options),
+      m_Nodes(),
+      m_Primitives(nullptr),
+      m_OwnedPrimitives(nullptr),
+      m_PrimitiveIndices(),
+      m_PackedLeaves(),
+      m_BVH4(nullptr),
+      m_BVH8(nullptr),
+      m_RootSurfaceArea(0.f),
+      m_BuildSAHCost(0.f)
+{
+    if (m_Options.width != 2 && m_Options.width != 4 && m_Options.width != 8)
     {
-        // Create leaf
-        node->bounds = objects[0]->WorldBound();
-        node->object = objects[0];
-        node->left = nullptr;
-        node->right = nullptr;
-        return node;
+        spdlog::warn("[BVHAccel] Unsupported BVH width {}, using 2", m_Options.width);
+        m_Options.width = 2;
     }
-    else if (objects.size() == 2)
+    if (m_Options.quantized && m_Options.width == 2)
     {
-        // Create leaf at next depth
-        node->left = recursiveBuild(std::vector<std::shared_ptr<Hittable>>{ objects[0] });
-        node->right =
-            recursiveBuild(std::vector<std::shared_ptr<Hittable>>{ objects[1] });
-        node->bounds = Union(node->left->bounds, node->right->bounds);
-        return node;
+        spdlog::warn("[BVHAccel] Quantized nodes need width 4 or 8, using full nodes");
+        m_Options.quantized = false;
     }
-    else  // >= 3
+}
+
+BVHAccel::~BVHAccel() = default;
+
+// Public Methods
+bool BVHAccel::Intersect(const Ray& ray, Float tMin, Float tMax, RayHit& hit) const
+{
+    if (m_BVH4) return m_BVH4->Intersect(*m_Primitives, m_PrimitiveIndices,
+                                         m_PackedLeaves, ray, tMin, tMax, hit);
+    if (m_BVH8) return m_BVH8->Intersect(*m_Primitives, m_PrimitiveIndices,
+                                         m_PackedLeaves, ray, tMin, tMax, hit);
+    if (m_Nodes.empty()) return false;
+
+    std::array<int, 3> dirIsNeg = { ray.dir.x < 0, ray.dir.y < 0, ray.dir.z < 0 };
+
+    bool hitAnything = false;
+
+    // Nodes to visit
+    int toVisit[MaxDepth];
+    int toVisitOffset = 0;
+    int currentNodeIndex = 0;
+
+    while (true)
     {
-        // Splitting into two nodes
-        Bounds3 centroidBounds;
-        for (const auto& object : objects)
+        const LinearBVHNode& node = m_Nodes[currentNodeIndex];
+
+        if (node.bounds.IntersectP(ray, ray.invDir, dirIsNeg, tMax))
+        {
+            if (node.IsLeaf())
+            {
+                // Clip tMax to the closest hit so far to cull farther nodes
+                if (m_Primitives->IntersectLeaf(m_PackedLeaves, m_PrimitiveIndices,
+                                                node.primitivesOffset, node.numPrimitives,
+                                                ray, tMin, tMax, hit))
+                {
+                    hitAnything = true;
+                    tMax = hit.t;
+                }
+
+                if (toVisitOffset == 0) break;
+                currentNodeIndex = toVisit[--toVisitOffset];
+            }
+            else
+            {
+                // Visit the near child first and put the far child on the stack
+                if (dirIsNeg[node.axis])
+                {
+                    toVisit[toVisitOffset++] = node.childOffset;
+                    currentNodeIndex = node.childOffset + 1;
+                }
+                else
+                {
+                    toVisit[toVisitOffset++] = node.childOffset + 1;
+                    currentNodeIndex = node.childOffset;
+                }
+            }
+        }
+        else
         {
-            centroidBounds = Union(centroidBounds, object->WorldBound().Centroid());
+            if (toVisitOffset == 0) break;
+            currentNodeIndex = toVisit[--toVisitOffset];
         }
+    }
 
-        int dimension = centroidBounds.MaxExtent();
-        switch (dimension)
+    return hitAnything;
+}
+
+void BVHAccel::ComputeHitRecord(const Ray& ray, const RayHit& hit,
+                                HitRecord& hitRecord) const
+{
+    m_Primitives->ComputePrimitiveHitRecord(ray, hit, hitRecord);
+}
+
+bool BVHAccel::Occluded(const Ray& ray, Float tMin, Float tMax) const
+{
+    if (m_BVH4) return m_BVH4->Occluded(*m_Primitives, m_PrimitiveIndices, m_PackedLeaves,
+                                        ray, tMin, tMax);
+    if (m_BVH8) return m_BVH8->Occluded(*m_Primitives, m_PrimitiveIndices, m_PackedLeaves,
+                                        ray, tMin, tMax);
+    if (m_Nodes.empty()) return false;
+
+    std::array<int, 3> dirIsNeg = { ray.dir.x < 0, ray.dir.y < 0, ray.dir.z < 0 };
+
+    // Nodes to visit
+    int toVisit[MaxDepth];
+    int toVisitOffset = 0;
+    int currentNodeIndex = 0;
+
+    while (true)
+    {
+        const LinearBVHNode& node = m_Nodes[currentNodeIndex];
+
+        if (node.bounds.IntersectP(ray, ray.invDir, dirIsNeg, tMax))
         {
-        case 0:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2)
+            if (node.IsLeaf())
             {
-              return f1->WorldBound().Centroid().x < f2->WorldBound().Centroid().x;
-            });
-            break;
-        case 1:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2)
+                // Any hit will do
+                if (m_Primitives->OccludedLeaf(m_PackedLeaves, m_PrimitiveIndices,
+                                               node.primitivesOffset, node.numPrimitives,
+                                               ray, tMin, tMax))
+                {
+                    return true;
+                }
+
+                if (toVisitOffset == 0) break;
+                currentNodeIndex = toVisit[--toVisitOffset];
+            }
+            else
             {
-              return f1->WorldBound().Centroid().y < f2->WorldBound().Centroid().y;
-            });
-            break;
-        case 2:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2)
+                // Near child first: it is the more likely one to block the ray
+                if (dirIsNeg[node.axis])
+                {
+                    toVisit[toVisitOffset++] = node.childOffset;
+                    currentNodeIndex = node.childOffset + 1;
+                }
+                else
+                {
+                    toVisit[toVisitOffset++] = node.childOffset + 1;
+                    currentNodeIndex = node.childOffset;
+                }
+            }
+        }
+        else
+        {
+            if (toVisitOffset == 0) break;
+            currentNodeIndex = toVisit[--toVisitOffset];
+        }
+    }
+
+    return false;
+}
+
+uint32_t BVHAccel::IntersectPacket(const RayPacket& packet, uint32_t activeMask,
+                                   Float tMin, Float tMax[], RayHit hits[]) const
+{
+    if (m_Nodes.empty()) return 0;
+
+    uint32_t hitMask = 0;
+
+    // Nodes to visit, each with the rays that reached it
+    int      toVisit[MaxDepth];
+    uint32_t toVisitMask[MaxDepth];
+    int      toVisitOffset = 0;
+    int      currentNodeIndex = 0;
+    uint32_t currentMask = activeMask;
+
+    while (true)
+    {
+        const LinearBVHNode& node = m_Nodes[currentNodeIndex];
+
+        // Rays that hit closer in the meantime may drop out here
+        uint32_t mask = IntersectBoundsPacket(node.bounds, packet, currentMask, tMax);
+        if (mask)
+        {
+            if (node.IsLeaf())
             {
-              return f1->WorldBound().Centroid().z < f2->WorldBound().Centroid().z;
-            });
-            break;
+                hitMask |= m_Primitives->IntersectPrimitivesPacket(
+                    &m_PrimitiveIndices[node.primitivesOffset], node.numPrimitives, packet,
+                    mask, tMin, tMax, hits);
+
+                if (toVisitOffset == 0) break;
+                --toVisitOffset;
+                currentNodeIndex = toVisit[toVisitOffset];
+                currentMask = toVisitMask[toVisitOffset];
+            }
+            else
+            {
+                // Near child first, as seen by the first ray; coherent rays agree
+                bool nearIsSecond = FirstDirIsNeg(packet, mask, node.axis);
+                toVisit[toVisitOffset] = node.childOffset + !nearIsSecond;
+                toVisitMask[toVisitOffset++] = mask;
+                currentNodeIndex = node.childOffset + nearIsSecond;
+                currentMask = mask;
+            }
+        }
+        else
+        {
+            if (toVisitOffset == 0) break;
+            --toVisitOffset;
+            currentNodeIndex = toVisit[toVisitOffset];
+            currentMask = toVisitMask[toVisitOffset];
+        }
+    }
+
+    return hitMask;
+}
+
+uint32_t BVHAccel::OccludedPacket(const RayPacket& packet, uint32_t activeMask,
+                                  Float tMin, const Float tMax[]) const
+{
+    if (m_Nodes.empty()) return 0;
+
+    uint32_t occludedMask = 0;
+
+    int      toVisit[MaxDepth];
+    uint32_t toVisitMask[MaxDepth];
+    int      toVisitOffset = 0;
+    int      currentNodeIndex = 0;
+    uint32_t currentMask = activeMask;
+
+    while (true)
+    {
+        const LinearBVHNode& node = m_Nodes[currentNodeIndex];
+
+        // Occluded rays are done and leave the packet
+        uint32_t mask =
+            IntersectBoundsPacket(node.bounds, packet, currentMask & ~occludedMask, tMax);
+        if (mask)
+        {
+            if (node.IsLeaf())
+            {
+                occludedMask |= m_Primitives->OccludedPrimitivesPacket(
+                    &m_PrimitiveIndices[node.primitivesOffset], node.numPrimitives, packet,
+                    mask, tMin, tMax);
+                if (occludedMask == activeMask) break;
+
+                if (toVisitOffset == 0) break;
+                --toVisitOffset;
+                currentNodeIndex = toVisit[toVisitOffset];
+                currentMask = toVisitMask[toVisitOffset];
+            }
+            else
+            {
+                bool nearIsSecond = FirstDirIsNeg(packet, mask, node.axis);
+                toVisit[toVisitOffset] = node.childOffset + !nearIsSecond;
+                toVisitMask[toVisitOffset++] = mask;
+                currentNodeIndex = node.childOffset + nearIsSecond;
+                currentMask = mask;
+            }
+        }
+        else
+        {
+            if (toVisitOffset == 0) break;
+            --toVisitOffset;
+            currentNodeIndex = toVisit[toVisitOffset];
+            currentMask = toVisitMask[toVisitOffset];
+        }
+    }
+
+    return occludedMask;
+}
+
+Bounds3 BVHAccel::WorldBound() const
+{
+    return m_Nodes.empty() ? Bounds3() : m_Nodes[0].bounds;
+}
+
+Float BVHAccel::SAHCost() const
+{
+    if (m_Nodes.empty()) return 0.f;
+
+    // Area-weighted sum over all nodes
+    Float cost = 0.f;
+    for (const LinearBVHNode& node : m_Nodes)
+    {
+        Float area = node.bounds.SurfaceArea();
+        cost += node.IsLeaf() ? m_Options.leafCost * node.numPrimitives * area
+                              : m_Options.traversalCost * area;
+    }
+
+    Float rootArea = m_Nodes[0].bounds.SurfaceArea();
+    return (rootArea > 0.f) ? cost / rootArea : cost;
+}
+
+bool BVHAccel::Refit(Float maxCostRatio)
+{
+    if (m_Nodes.empty()) return false;
+
+    int numNodes = static_cast<int>(m_Nodes.size());
+
+    std::vector<int> levelOffset;
+    std::vector<int> order = nodesByLevel(levelOffset);
+    int              numLevels = static_cast<int>(levelOffset.size()) - 1;
+
+    // Bottom-up, one level at a time: every level only reads the one below
+    for (int level = numLevels - 1; level >= 0; --level)
+    {
+        ParallelFor(levelOffset[level], levelOffset[level + 1], ParallelChunkSize,
+                    [&](int begin, int end) {
+                        for (int i = begin; i < end; ++i)
+                        {
+                            refitNode(order[i]);
+                        }
+                    });
+    }
+
+    buildWideBVH();
+
+    // Refitting keeps the topology, so the tree degrades as objects move apart
+    Float cost = SAHCost();
+    if (cost > maxCostRatio * m_BuildSAHCost)
+    {
+        spdlog::info("[BVHAccel] Refit SAH cost {:.3f} exceeds {:.2f}x the built {:.3f}, "
+                     "rebuilding",
+                     cost, maxCostRatio, m_BuildSAHCost);
+        build();
+        return true;
+    }
+    packLeaves();
+
+    spdlog::debug("[BVHAccel] Refit, #nodes: {}, SAH cost: {:.3f}", numNodes, cost);
+    return false;
+}
+
+// Private Methods
+
+// Builds over all primitives of the set; a rebuild also drops spatial split duplicates
+void BVHAccel::build()
+{
+    auto start = std::chrono::steady_clock::now();
+
+    m_Nodes.clear();
+    m_PrimitiveIndices.clear();
+    m_PackedLeaves.clear();
+    m_BVH4.reset();
+    m_BVH8.reset();
+
+    int numObjects = m_Primitives->NumPrimitives();
+    if (numObjects == 0) return;
+
+    // The treelet optimizer works on single-object leaves and forms the final leaves
+    // itself, where the SAH favors them
+    int maxLeafSize = m_Options.maxLeafSize;
+    if (m_Options.optimizePasses > 0) m_Options.maxLeafSize = 1;
+
+    if (m_Options.splitMethod == BVHBuildOptions::SBVH)
+    {
+        // Spatial splits duplicate references, so SBVH builds lists of them
+        BVHBuildRefs refs;
+        refs.primitives.resize(numObjects);
+        refs.bounds.resize(numObjects);
+        ParallelFor(0, numObjects, ParallelChunkSize, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i)
+            {
+                refs.primitives[i] = i;
+                refs.bounds[i] = m_Primitives->PrimitiveBound(i);
+            }
+        });
+
+        Bounds3 rootBounds;
+        for (const Bounds3& b : refs.bounds)
+        {
+            rootBounds = Union(rootBounds, b);
+        }
+        m_RootSurfaceArea = rootBounds.SurfaceArea();
+        int splitBudget = static_cast<int>(numObjects * Max(m_Options.splitBudget, 0.f));
+
+        std::shared_ptr<BVHNode> root = recursiveBuild(std::move(refs), 0, splitBudget);
+
+        // Flatten into a contiguous array
+        m_PrimitiveIndices.reserve(numObjects);
+        m_Nodes.resize(1);
+        flatten(*root, 0);
+    }
+    else
+    {
+        // Every leaf holds at least one object, so the nodes fit in 2n - 1 entries
+        BVHBuildPrims prims(*m_Primitives);
+        m_Nodes.resize(2 * numObjects - 1);
+        if (m_Options.splitMethod == BVHBuildOptions::LBVH)
+        {
+            buildLBVH(prims);
+        }
+        else
+        {
+            prims.scratch.resize(numObjects);
+            buildObjects(prims, 0, numObjects, 0, 0);
+        }
+        m_Nodes.resize(prims.numNodes);
+        m_PrimitiveIndices.swap(prims.indices);
+    }
+
+    m_Options.maxLeafSize = maxLeafSize;
+    if (m_Options.optimizePasses > 0) optimizeTreelets();
+    layoutNodes();
+
+    buildWideBVH();
+    packLeaves();
+    m_BuildSAHCost = SAHCost();
+
+    std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+    int    hrs = (int)diff.count() / 3600;
+    int    mins = ((int)diff.count() / 60) - (hrs * 60);
+    double secs = diff.count() - (hrs * 3600) - (mins * 60);
+
+    spdlog::info("[BVHAccel] BVH Generation Complete: {} hrs, {} mins, {:.3f} secs", hrs,
+                 mins, secs);
+    spdlog::info("[BVHAccel] {} split, #objects: {}, #nodes: {}, SAH cost: {:.3f}",
+                 SplitMethodName(m_Options.splitMethod), numObjects, m_Nodes.size(),
+                 m_BuildSAHCost);
+    if (static_cast<int>(m_PrimitiveIndices.size()) > numObjects)
+    {
+        spdlog::info("[BVHAccel] Spatial splits added {} references",
+                     m_PrimitiveIndices.size() - numObjects);
+    }
+    if (m_BVH4 || m_BVH8)
+    {
+        int numNodes = m_BVH4 ? m_BVH4->NumNodes() : m_BVH8->NumNodes();
+        int nodeSize = m_BVH4 ? m_BVH4->NodeSize() : m_BVH8->NodeSize();
+        spdlog::info("[BVHAccel] Collapsed into {}BVH{}, #nodes: {}, {} KB",
+                     m_Options.quantized ? "quantized " : "", m_Options.width, numNodes,
+                     numNodes * nodeSize / 1024);
+    }
+    if (!m_PackedLeaves.empty())
+    {
+        spdlog::info("[BVHAccel] Packed leaves, {} KB",
+                     m_PackedLeaves.size() * sizeof(Float) / 1024);
+    }
+}
+
+bool BVHAccel::loadCache(const BVHCache& cache)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    int numObjects = m_Primitives->NumPrimitives();
+    if (!cache.Load(numObjects, m_Nodes, m_PrimitiveIndices))
+    {
+        spdlog::debug("[BVHAccel] No cached BVH at {}", cache.Path());
+        return false;
+    }
+
+    buildWideBVH();
+    packLeaves();
+    m_BuildSAHCost = SAHCost();
+
+    std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+    spdlog::info("[BVHAccel] Loaded BVH from {} in {:.3f} secs, #objects: {}, #nodes: {}",
+                 cache.Path(), diff.count(), numObjects, m_Nodes.size());
+    return true;
+}
+
+void BVHAccel::saveCache(const BVHCache& cache) const
+{
+    if (cache.Save(m_Primitives->NumPrimitives(), m_Nodes, m_PrimitiveIndices))
+        spdlog::info("[BVHAccel] Saved BVH to {}", cache.Path());
+    else
+        spdlog::warn("[BVHAccel] Failed to save BVH to {}", cache.Path());
+}
+
+void BVHAccel::buildWideBVH()
+{
+    m_BVH4.reset();
+    m_BVH8.reset();
+
+    if (m_Options.width == 4)
+        m_BVH4 = std::make_unique<WideBVH<4>>(m_Nodes, m_Options.quantized);
+    else if (m_Options.width == 8)
+        m_BVH8 = std::make_unique<WideBVH<8>>(m_Nodes, m_Options.quantized);
+}
+
+// Leaves hold the primitives by reference, so their copy follows every build and refit
+void BVHAccel::packLeaves()
+{
+    if (m_Options.packLeaves)
+        m_Primitives->PackLeaves(m_PrimitiveIndices, m_PackedLeaves);
+    else
+        m_PackedLeaves.clear();
+}
+
+void BVHAccel::refitNode(int nodeIndex)
+{
+    LinearBVHNode& node = m_Nodes[nodeIndex];
+    if (node.IsLeaf())
+    {
+        // Clipped SBVH bounds are lost here; the whole object is always conservative
+        Bounds3 bounds;
+        for (int i = 0; i < node.numPrimitives; ++i)
+        {
+            int index = m_PrimitiveIndices[node.primitivesOffset + i];
+            bounds = Union(bounds, m_Primitives->PrimitiveBound(index));
         }
+        node.bounds = bounds;
+    }
+    else
+    {
+        node.bounds =
+            Union(m_Nodes[node.childOffset].bounds, m_Nodes[node.childOffset + 1].bounds);
+    }
+}
+
+// SBVH build over lists of references, which spatial splits may duplicate
+std::shared_ptr<BVHNode> BVHAccel::recursiveBuild(BVHBuildRefs refs, int depth,
+                                                  int splitBudget)
+{
+    std::shared_ptr<BVHNode> node = std::make_shared<BVHNode>();
+
+    int  numObjects = refs.Size();
+    bool parallel = numObjects >= ParallelBuildThreshold;
 
-        auto begin = objects.begin();
-        auto middle = objects.begin() + (objects.size() / 2);
-        auto end = objects.end();
+    // Bounds (reduced per chunk)
+    int                  numChunks = NumChunks(numObjects, parallel);
+    std::vector<Bounds3> chunkBounds(numChunks);
+    std::vector<Bounds3> chunkCentroidBounds(numChunks);
 
-        auto leftObjects = std::vector<std::shared_ptr<Hittable>>(begin, middle);
-        auto rightObjects = std::vector<std::shared_ptr<Hittable>>(middle, end);
+    ForEachChunk(numObjects, numChunks, [&](int chunk, int begin, int end) {
+        for (int i = begin; i < end; ++i)
+        {
+            chunkBounds[chunk] = Union(chunkBounds[chunk], refs.bounds[i]);
+            chunkCentroidBounds[chunk] =
+                Union(chunkCentroidBounds[chunk], refs.bounds[i].Centroid());
+        }
+    });
 
-        node->left = recursiveBuild(leftObjects);
-        node->right = recursiveBuild(rightObjects);
+    Bounds3 bounds;
+    Bounds3 centroidBounds;
+    for (int chunk = 0; chunk < numChunks; ++chunk)
+    {
+        bounds = Union(bounds, chunkBounds[chunk]);
+        centroidBounds = Union(centroidBounds, chunkCentroidBounds[chunk]);
+    }
 
-        node->bounds = Union(node->left->bounds, node->right->bounds);
+    int  maxLeafSize = Clamp(m_Options.maxLeafSize, 1, (int)UINT16_MAX);
+    bool canBeLeaf = numObjects <= maxLeafSize;
 
+    if (numObjects == 1)
+    {
+        // Create leaf
+        node->bounds = bounds;
+        node->primitives = std::move(refs.primitives);
         return node;
     }
-}
\ No newline at end of file
+    else
+    {
+        // Median splits halve the object count, so falling back to them deep down
+        // keeps the tree within the traversal stack
+        SAHSplit             object;
+        std::vector<uint8_t> goesLeft;
+        bool                 objectSplit = false;
+        object.cost = Infinity;
+        if (depth < MaxDepth / 2 && splitSAH(refs, bounds, centroidBounds, object))
+        {
+            objectSplit = true;
+            goesLeft.resize(numObjects);
+            ForEachChunk(numObjects, numChunks, [&](int, int begin, int end) {
+                for (int i = begin; i < end; ++i)
+                {
+                    goesLeft[i] = object.GoesLeft(refs.Centroid(i));
+                }
+            });
+        }
+
+        // Spatial splits only pay off where the object split leaves the children
+        // overlapping noticeably
+        SpatialSplit spatial;
+        bool         spatialSplit = false;
+        if (depth < MaxDepth / 2 && splitBudget > 0)
+        {
+            bool overlapping = true;
+            if (objectSplit)
+            {
+                Bounds3 leftBounds, rightBounds;
+                for (int i = 0; i < numObjects; ++i)
+                {
+                    if (goesLeft[i])
+                        leftBounds = Union(leftBounds, refs.bounds[i]);
+                    else
+                        rightBounds = Union(rightBounds, refs.bounds[i]);
+                }
+
+                Bounds3 overlap = ::Intersect(leftBounds, rightBounds);
+                overlapping = !overlap.IsEmpty() && overlap.SurfaceArea() >
+                                                        SpatialSplitOverlap * m_RootSurfaceArea;
+            }
+
+            if (overlapping)
+            {
+                spatialSplit = splitSpatial(refs, bounds, splitBudget, spatial) &&
+                               spatial.cost < object.cost;
+            }
+        }
+
+        if (objectSplit || spatialSplit)
+        {
+            // Keep the objects together if that is cheaper than any split
+            Float splitCost = spatialSplit ? spatial.cost : object.cost;
+            if (canBeLeaf && m_Options.leafCost * numObjects <= splitCost)
+            {
+                node->bounds = bounds;
+                node->primitives = std::move(refs.primitives);
+                return node;
+            }
+
+            BVHBuildRefs leftRefs, rightRefs;
+            int          leftBudget = splitBudget, rightBudget = splitBudget;
+            if (spatialSplit)
+            {
+                node->axis = spatial.axis;
+                partitionSpatial(refs, spatial, leftRefs, rightRefs);
+
+                // Share the remaining budget by the size of the children
+                int numLeft = leftRefs.Size(), numRight = rightRefs.Size();
+                int remaining = Max(splitBudget - (numLeft + numRight - numObjects), 0);
+                leftBudget = static_cast<int>((int64_t)remaining * numLeft /
+                                              (numLeft + numRight));
+                rightBudget = remaining - leftBudget;
+            }
+            else
+            {
+                node->axis = object.axis;
+                partitionObjects(refs, goesLeft, leftRefs, rightRefs);
+
+                leftBudget = static_cast<int>((int64_t)splitBudget * leftRefs.Size() /
+                                              numObjects);
+                rightBudget = splitBudget - leftBudget;
+            }
+
+            buildChildren(*node, std::move(leftRefs), std::move(rightRefs), depth,
+                          leftBudget, rightBudget);
+            return node;
+        }
+
+        if (canBeLeaf)
+        {
+            node->bounds = bounds;
+            node->primitives = std::move(refs.primitives);
+            return node;
+        }
+
+        int dimension = centroidBounds.MaxExtent();
+        node->axis = dimension;
+
+        std::vector<int> order(numObjects);
+        for (int i = 0; i < numObjects; ++i)
+        {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&](int i1, int i2) {
+            return refs.bounds[i1].Centroid()[dimension] <
+                   refs.bounds[i2].Centroid()[dimension];
+        });
+
+        int          middle = numObjects / 2;
+        BVHBuildRefs leftRefs, rightRefs;
+        for (int i = 0; i < numObjects; ++i)
+        {
+            BVHBuildRefs& side = (i < middle) ? leftRefs : rightRefs;
+            side.primitives.push_back(std::move(refs.primitives[order[i]]));
+            side.bounds.push_back(refs.bounds[order[i]]);
+        }
+
+        int leftBudget = splitBudget / 2;
+        buildChildren(*node, std::move(leftRefs), std::move(rightRefs), depth, leftBudget,
+                      splitBudget - leftBudget);
+
+        return node;
+    }
+}
+
+// Stable partition: count per chunk, then scatter at the chunk's offsets
+void BVHAccel::partitionObjects(BVHBuildRefs& refs, const std::vector<uint8_t>& goesLeft,
+                                BVHBuildRefs& leftRefs, BVHBuildRefs& rightRefs) const
+{
+    int numObjects = refs.Size();
+    int numChunks = NumChunks(numObjects, numObjects >= ParallelBuildThreshold);
+
+    std::vector<int> chunkNumLeft(numChunks, 0);
+    ForEachChunk(numObjects, numChunks, [&](int chunk, int begin, int end) {
+        for (int i = begin; i < end; ++i)
+        {
+            chunkNumLeft[chunk] += goesLeft[i];
+        }
+    });
+
+    std::vector<int> chunkLeftOffset(numChunks);
+    int              numLeft = 0;
+    for (int chunk = 0; chunk < numChunks; ++chunk)
+    {
+        chunkLeftOffset[chunk] = numLeft;
+        numLeft += chunkNumLeft[chunk];
+    }
+
+    leftRefs.primitives.resize(numLeft);
+    leftRefs.bounds.resize(numLeft);
+    rightRefs.primitives.resize(numObjects - numLeft);
+    rightRefs.bounds.resize(numObjects - numLeft);
+    ForEachChunk(numObjects, numChunks, [&](int chunk, int begin, int end) {
+        int leftOffset = chunkLeftOffset[chunk];
+        int rightOffset = begin - leftOffset;
+        for (int i = begin; i < end; ++i)
+        {
+            BVHBuildRefs& side = goesLeft[i] ? leftRefs : rightRefs;
+            int&          offset = goesLeft[i] ? leftOffset : rightOffset;
+            side.primitives[offset] = std::move(refs.primitives[i]);
+            side.bounds[offset] = refs.bounds[i];
+            ++offset;
+        }
+    });
+}
+
+// Builds both subtrees, the left one as a separate task if both are large
+void BVHAccel::buildChildren(BVHNode& node, BVHBuildRefs leftRefs, BVHBuildRefs rightRefs,
+                             int depth, int leftBudget, int rightBudget)
+{
+    if (Min(leftRefs.Size(), rightRefs.Size()) >= ParallelSubtreeThreshold)
+    {
+        TaskGroup group;
+        group.Run([&]() {
+            node.left = recursiveBuild(std::move(leftRefs), depth + 1, leftBudget);
+        });
+        node.right = recursiveBuild(std::move(rightRefs), depth + 1, rightBudget);
+        group.Wait();
+    }
+    else
+    {
+        node.left = recursiveBuild(std::move(leftRefs), depth + 1, leftBudget);
+        node.right = recursiveBuild(std::move(rightRefs), depth + 1, rightBudget);
+    }
+
+    node.bounds = Union(node.left->bounds, node.right->bounds);
+}
+
+// Median and SAH build of the objects [begin, end) into m_Nodes[nodeIndex]. A split
+// partitions the range of indices in place, and a leaf keeps its range: the index
+// array ends up in leaf order.
+void BVHAccel::buildObjects(BVHBuildPrims& prims, int begin, int end, int depth,
+                            int nodeIndex)
+{
+    BVHBuildRange range{ prims, begin, end };
+
+    int  numObjects = range.Size();
+    bool parallel = numObjects >= ParallelBuildThreshold;
+
+    // Bounds (reduced per chunk)
+    int                  numChunks = NumChunks(numObjects, parallel);
+    std::vector<Bounds3> chunkBounds(numChunks);
+    std::vector<Bounds3> chunkCentroidBounds(numChunks);
+
+    ForEachChunk(numObjects, numChunks, [&](int chunk, int first, int last) {
+        for (int i = first; i < last; ++i)
+        {
+            chunkBounds[chunk] = Union(chunkBounds[chunk], range.Bounds(i));
+            chunkCentroidBounds[chunk] =
+                Union(chunkCentroidBounds[chunk], range.Centroid(i));
+        }
+    });
+
+    Bounds3 bounds;
+    Bounds3 centroidBounds;
+    for (int chunk = 0; chunk < numChunks; ++chunk)
+    {
+        bounds = Union(bounds, chunkBounds[chunk]);
+        centroidBounds = Union(centroidBounds, chunkCentroidBounds[chunk]);
+    }
+
+    // m_Nodes is never resized during the build, so concurrent subtrees may write
+    // their own nodes
+    LinearBVHNode& node = m_Nodes[nodeIndex];
+    node.bounds = bounds;
+    node.axis = 0;
+    node.pad[0] = 0;
+
+    int  maxLeafSize = Clamp(m_Options.maxLeafSize, 1, (int)UINT16_MAX);
+    bool canBeLeaf = numObjects <= maxLeafSize;
+
+    auto createLeaf = [&]() {
+        node.primitivesOffset = begin;
+        node.numPrimitives = static_cast<uint16_t>(numObjects);
+    };
+
+    if (numObjects == 1 ||
+        (canBeLeaf && m_Options.splitMethod == BVHBuildOptions::Median))
+    {
+        createLeaf();
+        return;
+    }
+
+    // Median splits halve the object count, so falling back to them deep down keeps
+    // the tree within the traversal stack
+    int      middle;
+    SAHSplit split;
+    if (m_Options.splitMethod == BVHBuildOptions::SAH && depth < MaxDepth / 2 &&
+        splitSAH(range, bounds, centroidBounds, split))
+    {
+        // Keep the objects together if that is cheaper than any split
+        if (canBeLeaf && m_Options.leafCost * numObjects <= split.cost)
+        {
+            createLeaf();
+            return;
+        }
+
+        node.axis = static_cast<uint8_t>(split.axis);
+        middle = partitionIndices(prims, begin, end, split);
+    }
+    else if (canBeLeaf)
+    {
+        createLeaf();
+        return;
+    }
+    else
+    {
+        int dimension = centroidBounds.MaxExtent();
+        node.axis = static_cast<uint8_t>(dimension);
+
+        middle = begin + numObjects / 2;
+        std::nth_element(prims.indices.begin() + begin, prims.indices.begin() + middle,
+                         prims.indices.begin() + end, [&](int i1, int i2) {
+                             return prims.centroids[i1][dimension] <
+                                    prims.centroids[i2][dimension];
+                         });
+    }
+
+    int childOffset = prims.numNodes.fetch_add(2);
+    node.childOffset = childOffset;
+    node.numPrimitives = 0;
+
+    // The left subtree as a separate task if both are large
+    if (Min(middle - begin, end - middle) >= ParallelSubtreeThreshold)
+    {
+        TaskGroup group;
+        group.Run([&]() { buildObjects(prims, begin, middle, depth + 1, childOffset); });
+        buildObjects(prims, middle, end, depth + 1, childOffset + 1);
+        group.Wait();
+    }
+    else
+    {
+        buildObjects(prims, begin, middle, depth + 1, childOffset);
+        buildObjects(prims, middle, end, depth + 1, childOffset + 1);
+    }
+}
+
+// Stable partition of the indices [begin, end) by the side of the split: count per
+// chunk, scatter to the scratch buffer at the chunk's offsets and copy back. Returns
+// the start of the right side.
+int BVHAccel::partitionIndices(BVHBuildPrims& prims, int begin, int end,
+                               const SAHSplit& split) const
+{
+    int numObjects = end - begin;
+    int numChunks = NumChunks(numObjects, numObjects >= ParallelBuildThreshold);
+
+    int32_t* indices = prims.indices.data() + begin;
+    int32_t* scratch = prims.scratch.data() + begin;
+
+    std::vector<int> chunkNumLeft(numChunks, 0);
+    ForEachChunk(numObjects, numChunks, [&](int chunk, int first, int last) {
+        for (int i = first; i < last; ++i)
+        {
+            chunkNumLeft[chunk] += split.GoesLeft(prims.centroids[indices[i]]);
+        }
+    });
+
+    std::vector<int> chunkLeftOffset(numChunks);
+    int              numLeft = 0;
+    for (int chunk = 0; chunk < numChunks; ++chunk)
+    {
+        chunkLeftOffset[chunk] = numLeft;
+        numLeft += chunkNumLeft[chunk];
+    }
+
+    ForEachChunk(numObjects, numChunks, [&](int chunk, int first, int last) {
+        int leftOffset = chunkLeftOffset[chunk];
+        int rightOffset = numLeft + first - leftOffset;
+        for (int i = first; i < last; ++i)
+        {
+            int32_t index = indices[i];
+            if (split.GoesLeft(prims.centroids[index]))
+                scratch[leftOffset++] = index;
+            else
+                scratch[rightOffset++] = index;
+        }
+    });
+
+    ForEachChunk(numObjects, numChunks, [&](int, int first, int last) {
+        std::copy(scratch + first, scratch + last, indices + first);
+    });
+
+    return begin + numLeft;
+}
+
+// LBVH: sorts the objects along a Morton curve through the centroid bounds. Every
+// bit of the codes then splits a sorted range in two, which gives the hierarchy in
+// a single pass over the sorted array.
+void BVHAccel::buildLBVH(BVHBuildPrims& prims)
+{
+    int numObjects = static_cast<int>(prims.indices.size());
+    int numChunks = NumChunks(numObjects, numObjects >= ParallelBuildThreshold);
+
+    std::vector<Bounds3> chunkCentroidBounds(numChunks);
+    ForEachChunk(numObjects, numChunks, [&](int chunk, int begin, int end) {
+        for (int i = begin; i < end; ++i)
+        {
+            chunkCentroidBounds[chunk] =
+                Union(chunkCentroidBounds[chunk], prims.centroids[i]);
+        }
+    });
+
+    Bounds3 centroidBounds;
+    for (const Bounds3& b : chunkCentroidBounds)
+    {
+        centroidBounds = Union(centroidBounds, b);
+    }
+
+    // Quantize the centroids to a 1024^3 grid
+    const int    mortonBits = 10;
+    const Float  mortonScale = 1 << mortonBits;
+    std::vector<MortonPrimitive> mortonPrims(numObjects);
+    ForEachChunk(numObjects, numChunks, [&](int, int begin, int end) {
+        for (int i = begin; i < end; ++i)
+        {
+            Vector3f offset = centroidBounds.Offset(prims.centroids[i]);
+            Vector3f scaled = offset * mortonScale;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                scaled[axis] = Clamp(scaled[axis], (Float)0, mortonScale - 1);
+            }
+            mortonPrims[i].primitiveIndex = i;
+            mortonPrims[i].mortonCode = EncodeMorton3(scaled);
+        }
+    });
+
+    RadixSort(mortonPrims);
+
+    // Leaves are ranges of the sorted order
+    ForEachChunk(numObjects, numChunks, [&](int, int begin, int end) {
+        for (int i = begin; i < end; ++i)
+        {
+            prims.indices[i] = mortonPrims[i].primitiveIndex;
+        }
+    });
+
+    emitLBVH(prims, mortonPrims.data(), 0, numObjects, 3 * mortonBits - 1, 0);
+}
+
+// Splits the sorted range [begin, end) where bitIndex of the codes flips from 0 to 1
+void BVHAccel::emitLBVH(BVHBuildPrims& prims, const MortonPrimitive* mortonPrims,
+                        int begin, int end, int bitIndex, int nodeIndex)
+{
+    LinearBVHNode& node = m_Nodes[nodeIndex];
+    node.axis = 0;
+    node.pad[0] = 0;
+
+    int count = end - begin;
+    int maxLeafSize = Clamp(m_Options.maxLeafSize, 1, (int)UINT16_MAX);
+    if (count <= maxLeafSize)
+    {
+        // Create leaf
+        Bounds3 bounds;
+        for (int i = begin; i < end; ++i)
+        {
+            bounds = Union(bounds, prims.bounds[prims.indices[i]]);
+        }
+        node.bounds = bounds;
+        node.primitivesOffset = begin;
+        node.numPrimitives = static_cast<uint16_t>(count);
+        return;
+    }
+
+    int middle = begin + count / 2;  // identical codes: split in the middle
+    int axis = 0;
+    while (bitIndex >= 0)
+    {
+        uint32_t mask = 1u << bitIndex;
+        if ((mortonPrims[begin].mortonCode & mask) !=
+            (mortonPrims[end - 1].mortonCode & mask))
+        {
+            // Binary search for the first code with the bit set
+            const MortonPrimitive* split = std::partition_point(
+                mortonPrims + begin, mortonPrims + end,
+                [mask](const MortonPrimitive& p) { return (p.mortonCode & mask) == 0; });
+            middle = static_cast<int>(split - mortonPrims);
+            axis = 2 - bitIndex % 3;
+            break;
+        }
+
+        // All codes agree on this bit, so it does not split anything
+        --bitIndex;
+    }
+
+    int childOffset = prims.numNodes.fetch_add(2);
+    node.axis = static_cast<uint8_t>(axis);
+    node.childOffset = childOffset;
+    node.numPrimitives = 0;
+
+    if (Min(middle - begin, end - middle) >= ParallelSubtreeThreshold)
+    {
+        TaskGroup group;
+        group.Run([&]() {
+            emitLBVH(prims, mortonPrims, begin, middle, bitIndex - 1, childOffset);
+        });
+        emitLBVH(prims, mortonPrims, middle, end, bitIndex - 1, childOffset + 1);
+        group.Wait();
+    }
+    else
+    {
+        emitLBVH(prims, mortonPrims, begin, middle, bitIndex - 1, childOffset);
+        emitLBVH(prims, mortonPrims, middle, end, bitIndex - 1, childOffset + 1);
+    }
+
+    node.bounds = Union(m_Nodes[childOffset].bounds, m_Nodes[childOffset + 1].bounds);
+}
+
+// Binned SAH: bins the centroids along every axis and picks the plane between two
+// bins that minimizes the expected cost. Returns false if no plane separates the
+// objects (e.g. all centroids coincide). Refs is a BVHBuildRefs or a BVHBuildRange.
+template <typename Refs>
+bool BVHAccel::splitSAH(const Refs& refs, const Bounds3& bounds,
+                        const Bounds3& centroidBounds, SAHSplit& split) const
+{
+    struct Bin
+    {
+        Bin() : count(0), bounds() { }
+
+        int     count;
+        Bounds3 bounds;
+    };
+
+    const int numBins = Max(m_Options.numBins, 2);
+    const int numObjects = refs.Size();
+    const int numChunks = NumChunks(numObjects, numObjects >= ParallelBuildThreshold);
+
+    Float invArea = 1.f / Max(bounds.SurfaceArea(), MinFloat);
+
+    Float bestCost = Infinity;
+    int   bestAxis = -1;
+    int   bestSplit = -1;
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        Float minCentroid = centroidBounds.pMin[axis];
+        Float extent = centroidBounds.pMax[axis] - minCentroid;
+        if (centroidBounds.pMax[axis] <= minCentroid) continue;
+
+        // Bin every chunk separately and merge
+        std::vector<std::vector<Bin>> chunkBins(numChunks, std::vector<Bin>(numBins));
+        ForEachChunk(numObjects, numChunks, [&](int chunk, int begin, int end) {
+            for (int i = begin; i < end; ++i)
+            {
+                Bin& bin = chunkBins[chunk][SAHBin(refs.Centroid(i)[axis], minCentroid,
+                                                   extent, numBins)];
+                ++bin.count;
+                bin.bounds = Union(bin.bounds, refs.Bounds(i));
+            }
+        });
+
+        std::vector<Bin> bins(numBins);
+        for (int chunk = 0; chunk < numChunks; ++chunk)
+        {
+            for (int i = 0; i < numBins; ++i)
+            {
+                bins[i].count += chunkBins[chunk][i].count;
+                bins[i].bounds = Union(bins[i].bounds, chunkBins[chunk][i].bounds);
+            }
+        }
+
+        // Sweep from the right to get the area and count to the right of each plane
+        std::vector<Float> rightArea(numBins);
+        std::vector<int>   rightCount(numBins);
+        Bounds3            rightBounds;
+        int                count = 0;
+        for (int i = numBins - 1; i > 0; --i)
+        {
+            rightBounds = Union(rightBounds, bins[i].bounds);
+            count += bins[i].count;
+            rightArea[i] = count > 0 ? rightBounds.SurfaceArea() : 0.f;
+            rightCount[i] = count;
+        }
+
+        // Sweep from the left and evaluate the plane after bin i
+        Bounds3 leftBounds;
+        count = 0;
+        for (int i = 0; i < numBins - 1; ++i)
+        {
+            leftBounds = Union(leftBounds, bins[i].bounds);
+            count += bins[i].count;
+
+            if (count == 0 || count == numObjects) continue;
+
+            Float splitCost = m_Options.traversalCost +
+                         m_Options.leafCost * invArea *
+                             (count * leftBounds.SurfaceArea() +
+                              rightCount[i + 1] * rightArea[i + 1]);
+            if (splitCost < bestCost)
+            {
+                bestCost = splitCost;
+                bestAxis = axis;
+                bestSplit = i;
+            }
+        }
+    }
+
+    if (bestAxis < 0) return false;
+
+    split.axis = bestAxis;
+    split.bin = bestSplit;
+    split.numBins = numBins;
+    split.minCentroid = centroidBounds.pMin[bestAxis];
+    split.extent = centroidBounds.pMax[bestAxis] - centroidBounds.pMin[bestAxis];
+    split.cost = bestCost;
+    return true;
+}
+
+// Spatial split: bins the node bounds along every axis and clips every reference
+// into the bins it overlaps. References straddling the chosen plane end up in both
+// children, so only splits that duplicate at most splitBudget references count.
+bool BVHAccel::splitSpatial(const BVHBuildRefs& refs, const Bounds3& bounds,
+                            int splitBudget, SpatialSplit& split) const
+{
+    struct Bin
+    {
+        Bin() : entries(0), exits(0), bounds() { }
+
+        int     entries;  // #references starting in this bin
+        int     exits;    // #references ending in this bin
+        Bounds3 bounds;   // clipped to the bin
+    };
+
+    const int numBins = Max(m_Options.numBins, 2);
+    const int numObjects = refs.Size();
+    const int numChunks = NumChunks(numObjects, numObjects >= ParallelBuildThreshold);
+
+    Float invArea = 1.f / Max(bounds.SurfaceArea(), MinFloat);
+
+    split.cost = Infinity;
+    split.axis = -1;
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        Float origin = bounds.pMin[axis];
+        Float binWidth = (bounds.pMax[axis] - origin) / numBins;
+        if (binWidth <= 0) continue;
+
+        auto binIndex = [&](Float position) {
+            return Clamp(static_cast<int>((position - origin) / binWidth), 0, numBins - 1);
+        };
+
+        // Bin every chunk separately and merge
+        std::vector<std::vector<Bin>> chunkBins(numChunks, std::vector<Bin>(numBins));
+        ForEachChunk(numObjects, numChunks, [&](int chunk, int begin, int end) {
+            std::vector<Bin>& bins = chunkBins[chunk];
+            for (int i = begin; i < end; ++i)
+            {
+                int first = binIndex(refs.bounds[i].pMin[axis]);
+                int last = binIndex(refs.bounds[i].pMax[axis]);
+
+                // Walk the planes between first and last, clipping off one bin at a time
+                Bounds3 rest = refs.bounds[i];
+                for (int b = first; b < last; ++b)
+                {
+                    Bounds3 left, right;
+                    m_Primitives->SplitPrimitiveBound(refs.primitives[i], rest, axis,
+                                                  origin + (b + 1) * binWidth, left,
+                                                  right);
+                    bins[b].bounds = Union(bins[b].bounds, left);
+                    rest = right;
+                }
+                bins[last].bounds = Union(bins[last].bounds, rest);
+                ++bins[first].entries;
+                ++bins[last].exits;
+            }
+        });
+
+        std::vector<Bin> bins(numBins);
+        for (int chunk = 0; chunk < numChunks; ++chunk)
+        {
+            for (int i = 0; i < numBins; ++i)
+            {
+                bins[i].entries += chunkBins[chunk][i].entries;
+                bins[i].exits += chunkBins[chunk][i].exits;
+                bins[i].bounds = Union(bins[i].bounds, chunkBins[chunk][i].bounds);
+            }
+        }
+
+        // Sweep from the right: references ending right of a plane belong to the right
+        std::vector<Float> rightArea(numBins);
+        std::vector<int>   rightCount(numBins);
+        Bounds3            rightBounds;
+        int                count = 0;
+        for (int i = numBins - 1; i > 0; --i)
+        {
+            rightBounds = Union(rightBounds, bins[i].bounds);
+            count += bins[i].exits;
+            rightArea[i] = count > 0 ? rightBounds.SurfaceArea() : 0.f;
+            rightCount[i] = count;
+        }
+
+        // Sweep from the left: references starting left of a plane belong to the left
+        Bounds3 leftBounds;
+        count = 0;
+        for (int i = 0; i < numBins - 1; ++i)
+        {
+            leftBounds = Union(leftBounds, bins[i].bounds);
+            count += bins[i].entries;
+
+            int numLeft = count;
+            int numRight = rightCount[i + 1];
+            if (numLeft == 0 || numRight == 0) continue;
+            if (numLeft == numObjects && numRight == numObjects) continue;
+            if (numLeft + numRight - numObjects > splitBudget) continue;
+
+            Float splitCost = m_Options.traversalCost +
+                              m_Options.leafCost * invArea *
+                                  (numLeft * leftBounds.SurfaceArea() +
+                                   numRight * rightArea[i + 1]);
+            if (splitCost < split.cost)
+            {
+                split.cost = splitCost;
+                split.axis = axis;
+                split.position = origin + (i + 1) * binWidth;
+            }
+        }
+    }
+
+    return split.axis >= 0;
+}
+
+// Sends every reference to the side(s) of the plane it overlaps, clipping the ones
+// that straddle it
+void BVHAccel::partitionSpatial(BVHBuildRefs& refs, const SpatialSplit& split,
+                                BVHBuildRefs& leftRefs, BVHBuildRefs& rightRefs) const
+{
+    for (int i = 0; i < refs.Size(); ++i)
+    {
+        const Bounds3& b = refs.bounds[i];
+        if (b.pMax[split.axis] <= split.position)
+        {
+            leftRefs.primitives.push_back(std::move(refs.primitives[i]));
+            leftRefs.bounds.push_back(b);
+        }
+        else if (b.pMin[split.axis] >= split.position)
+        {
+            rightRefs.primitives.push_back(std::move(refs.primitives[i]));
+            rightRefs.bounds.push_back(b);
+        }
+        else
+        {
+            Bounds3 left, right;
+            m_Primitives->SplitPrimitiveBound(refs.primitives[i], b, split.axis,
+                                              split.position, left, right);
+
+            // Clipping may show that the object does not reach across after all
+            bool hasLeft = !left.IsEmpty();
+            bool hasRight = !right.IsEmpty();
+            if (hasLeft || !hasRight)
+            {
+                leftRefs.primitives.push_back(refs.primitives[i]);
+                leftRefs.bounds.push_back(hasLeft ? left : b);
+            }
+            if (hasRight)
+            {
+                rightRefs.primitives.push_back(std::move(refs.primitives[i]));
+                rightRefs.bounds.push_back(right);
+            }
+        }
+    }
+}
+
+// Writes node to m_Nodes[nodeIndex] and appends its children (as a sibling pair)
+// and leaf objects depth-first
+void BVHAccel::flatten(const BVHNode& node, int nodeIndex)
+{
+    LinearBVHNode linearNode;
+    linearNode.bounds = node.bounds;
+    linearNode.axis = static_cast<uint8_t>(node.axis);
+    linearNode.pad[0] = 0;
+
+    if (node.IsLeaf())
+    {
+        linearNode.primitivesOffset = static_cast<int32_t>(m_PrimitiveIndices.size());
+        linearNode.numPrimitives = static_cast<uint16_t>(node.primitives.size());
+        m_PrimitiveIndices.insert(m_PrimitiveIndices.end(), node.primitives.begin(),
+                                  node.primitives.end());
+        m_Nodes[nodeIndex] = linearNode;
+    }
+    else
+    {
+        int childOffset = static_cast<int>(m_Nodes.size());
+        linearNode.childOffset = childOffset;
+        linearNode.numPrimitives = 0;
+        m_Nodes[nodeIndex] = linearNode;
+
+        m_Nodes.resize(m_Nodes.size() + 2);
+        flatten(*node.left, childOffset);
+        flatten(*node.right, childOffset + 1);
+    }
+}
+
+// Reorders m_Nodes into page-sized clusters (see ClusteredLayout). The root stays at
+// 0 and sibling pairs stay together, starting at odd indices.
+void BVHAccel::layoutNodes()
+{
+    // Item 0 is the root, item p > 0 the sibling pair at nodes 2p - 1 and 2p
+    int numNodes = static_cast<int>(m_Nodes.size());
+    int numItems = (numNodes + 1) / 2;
+    int clusterSize = NodeClusterBytes / (2 * sizeof(LinearBVHNode));
+
+    std::vector<int> order =
+        ClusteredLayout(numItems, clusterSize, [&](int item, std::vector<int>& children) {
+            int first = (item == 0) ? 0 : 2 * item - 1;
+            int last = 2 * item;
+            for (int i = first; i <= last; ++i)
+            {
+                if (m_Nodes[i].IsLeaf()) continue;
+                children.push_back((m_Nodes[i].childOffset + 1) / 2);
+            }
+        });
+
+    // Nodes that the treelet optimizer cut off are not reached and get dropped
+    std::vector<int> newIndex(numNodes, -1);
+    int              next = 0;
+    for (int item : order)
+    {
+        if (item == 0)
+        {
+            newIndex[0] = next++;
+        }
+        else
+        {
+            newIndex[2 * item - 1] = next++;
+            newIndex[2 * item] = next++;
+        }
+    }
+
+    std::vector<LinearBVHNode> nodes(next);
+    for (int i = 0; i < numNodes; ++i)
+    {
+        if (newIndex[i] < 0) continue;
+
+        LinearBVHNode node = m_Nodes[i];
+        if (!node.IsLeaf()) node.childOffset = newIndex[node.childOffset];
+        nodes[newIndex[i]] = node;
+    }
+    m_Nodes.swap(nodes);
+}
+
+// Lists the nodes level by level, root first. Level d occupies
+// [levelOffset[d], levelOffset[d + 1]) of the returned list.
+std::vector<int> BVHAccel::nodesByLevel(std::vector<int>& levelOffset) const
+{
+    std::vector<int> order;
+    order.reserve(m_Nodes.size());
+    levelOffset.assign(1, 0);
+    if (m_Nodes.empty()) return order;
+
+    order.push_back(0);
+    for (size_t levelBegin = 0; levelBegin < order.size();)
+    {
+        size_t levelEnd = order.size();
+        levelOffset.push_back(static_cast<int>(levelEnd));
+        for (size_t i = levelBegin; i < levelEnd; ++i)
+        {
+            const LinearBVHNode& node = m_Nodes[order[i]];
+            if (node.IsLeaf()) continue;
+
+            order.push_back(node.childOffset);
+            order.push_back(node.childOffset + 1);
+        }
+        levelBegin = levelEnd;
+    }
+
+    return order;
+}
+
+// Treelet restructuring (Karras and Aila, HPG 2013). Bottom-up, every interior node
+// roots a treelet of up to 7 leaves, which is rearranged into the topology of least
+// SAH cost. Treelets rooted on the same level are disjoint, so a level is processed
+// in parallel. The build made single-object leaves; subtrees are collapsed into
+// leaves at the end wherever that is cheaper.
+void BVHAccel::optimizeTreelets()
+{
+    int   numNodes = static_cast<int>(m_Nodes.size());
+    Float initialCost = SAHCost();
+
+    TreeletCosts costs;
+    costs.cost.resize(numNodes);
+    costs.height.resize(numNodes);
+    costs.numPrimitives.resize(numNodes);
+
+    int pass = 0;
+    while (pass < m_Options.optimizePasses)
+    {
+        ++pass;
+
+        std::vector<int> levelOffset;
+        std::vector<int> order = nodesByLevel(levelOffset);
+        int              numLevels = static_cast<int>(levelOffset.size()) - 1;
+        std::atomic<int> numRestructured(0);
+
+        for (int level = numLevels - 1; level >= 0; --level)
+        {
+            ParallelFor(levelOffset[level], levelOffset[level + 1], TreeletChunkSize,
+                        [&](int begin, int end) {
+                            for (int i = begin; i < end; ++i)
+                            {
+                                if (restructureTreelet(order[i], level, costs))
+                                    ++numRestructured;
+                            }
+                        });
+        }
+
+        if (numRestructured == 0) break;
+    }
+
+    collapseLeaves(costs);
+
+    Float rootArea = m_Nodes[0].bounds.SurfaceArea();
+    spdlog::info("[BVHAccel] Treelet optimization, #passes: {}, SAH cost: {:.3f} -> "
+                 "{:.3f}",
+                 pass, initialCost, rootArea > 0.f ? costs.cost[0] / rootArea : 0.f);
+}
+
+// Leaf cost of numPrimitives objects in bounds, or infinity if they do not fit a leaf
+Float BVHAccel::leafCost(int numPrimitives, const Bounds3& bounds) const
+{
+    if (numPrimitives > Clamp(m_Options.maxLeafSize, 1, (int)UINT16_MAX)) return Infinity;
+    return m_Options.leafCost * numPrimitives * bounds.SurfaceArea();
+}
+
+// Updates the costs of rootIndex, whose subtrees below the treelet are final already.
+// Returns true if the treelet was rearranged.
+bool BVHAccel::restructureTreelet(int rootIndex, int rootDepth, TreeletCosts& costs)
+{
+    const LinearBVHNode& root = m_Nodes[rootIndex];
+    if (root.IsLeaf())
+    {
+        costs.cost[rootIndex] = m_Options.leafCost * root.numPrimitives *
+                                root.bounds.SurfaceArea();
+        costs.height[rootIndex] = 0;
+        costs.numPrimitives[rootIndex] = root.numPrimitives;
+        return false;
+    }
+
+    int left = root.childOffset;
+    int right = root.childOffset + 1;
+    int numPrimitives = costs.numPrimitives[left] + costs.numPrimitives[right];
+    costs.cost[rootIndex] =
+        Min(m_Options.traversalCost * root.bounds.SurfaceArea() + costs.cost[left] +
+                costs.cost[right],
+            leafCost(numPrimitives, root.bounds));
+    costs.height[rootIndex] = 1 + Max(costs.height[left], costs.height[right]);
+    costs.numPrimitives[rootIndex] = numPrimitives;
+
+    // Grow the treelet by opening the leaf with the largest surface area. The sibling
+    // pairs of the opened nodes are reused for the new topology.
+    int leaves[MaxTreeletLeaves] = { left, right };
+    int pairs[MaxTreeletLeaves - 1] = { root.childOffset };
+    int numLeaves = 2;
+    int numPairs = 1;
+    while (numLeaves < MaxTreeletLeaves)
+    {
+        int   largest = -1;
+        Float largestArea = -1.f;
+        for (int i = 0; i < numLeaves; ++i)
+        {
+            const LinearBVHNode& node = m_Nodes[leaves[i]];
+            if (!node.IsLeaf() && node.bounds.SurfaceArea() > largestArea)
+            {
+                largest = i;
+                largestArea = node.bounds.SurfaceArea();
+            }
+        }
+
+        if (largest < 0) break;
+
+        int childOffset = m_Nodes[leaves[largest]].childOffset;
+        pairs[numPairs++] = childOffset;
+        leaves[largest] = childOffset;
+        leaves[numLeaves++] = childOffset + 1;
+    }
+
+    // Two leaves only allow one topology
+    if (numLeaves < 3) return false;
+
+    // Best cost of every subset of leaves, smaller subsets first
+    const int     numSubsets = 1 << numLeaves;
+    Bounds3       bounds[1 << MaxTreeletLeaves];
+    Float         bestCost[1 << MaxTreeletLeaves];
+    int           bestHeight[1 << MaxTreeletLeaves];
+    int           subsetPrimitives[1 << MaxTreeletLeaves];
+    uint8_t       bestSplit[1 << MaxTreeletLeaves];
+    LinearBVHNode leafNodes[MaxTreeletLeaves];
+
+    for (int i = 0; i < numLeaves; ++i)
+    {
+        leafNodes[i] = m_Nodes[leaves[i]];
+        bounds[1 << i] = leafNodes[i].bounds;
+        bestCost[1 << i] = costs.cost[leaves[i]];
+        bestHeight[1 << i] = costs.height[leaves[i]];
+        subsetPrimitives[1 << i] = costs.numPrimitives[leaves[i]];
+    }
+
+    for (int subset = 1; subset < numSubsets; ++subset)
+    {
+        int lowest = subset & -subset;
+        if (subset == lowest) continue;
+
+        bounds[subset] = Union(bounds[subset ^ lowest], bounds[lowest]);
+        subsetPrimitives[subset] =
+            subsetPrimitives[subset ^ lowest] + subsetPrimitives[lowest];
+
+        // Every partition once: the part with the lowest leaf goes first
+        Float partitionCost = Infinity;
+        for (int part = (subset - 1) & subset; part > 0; part = (part - 1) & subset)
+        {
+            if (!(part & lowest)) continue;
+
+            Float c = bestCost[part] + bestCost[subset ^ part];
+            if (c < partitionCost)
+            {
+                partitionCost = c;
+                bestSplit[subset] = static_cast<uint8_t>(part);
+            }
+        }
+
+        int part = bestSplit[subset];
+        bestCost[subset] =
+            Min(m_Options.traversalCost * bounds[subset].SurfaceArea() + partitionCost,
+                leafCost(subsetPrimitives[subset], bounds[subset]));
+        bestHeight[subset] = 1 + Max(bestHeight[part], bestHeight[subset ^ part]);
+    }
+
+    // Keep the current topology unless the gain is more than rounding noise, or the
+    // new one would overflow the traversal stack
+    const int all = numSubsets - 1;
+    if (bestCost[all] >= costs.cost[rootIndex] * (1.f - 1e-5f)) return false;
+    if (rootDepth + bestHeight[all] >= MaxDepth) return false;
+
+    // Write the new topology depth-first, root in place
+    int stack[2 * MaxTreeletLeaves][2];  // subset, node index
+    int stackSize = 0;
+    int nextPair = 0;
+    stack[stackSize][0] = all;
+    stack[stackSize++][1] = rootIndex;
+    while (stackSize > 0)
+    {
+        --stackSize;
+        int subset = stack[stackSize][0];
+        int nodeIndex = stack[stackSize][1];
+
+        costs.cost[nodeIndex] = bestCost[subset];
+        costs.height[nodeIndex] = bestHeight[subset];
+        costs.numPrimitives[nodeIndex] = subsetPrimitives[subset];
+
+        if ((subset & (subset - 1)) == 0)
+        {
+            int leaf = 0;
+            while ((1 << leaf) != subset) ++leaf;
+
+            m_Nodes[nodeIndex] = leafNodes[leaf];
+            continue;
+        }
+
+        int part = bestSplit[subset];
+        int pair = pairs[nextPair++];
+
+        // Split along the axis that separates the children most, for near-first order
+        Vector3f d = bounds[part].Centroid() - bounds[subset ^ part].Centroid();
+        int      axis = 0;
+        for (int a = 1; a < 3; ++a)
+        {
+            if (std::abs(d[a]) > std::abs(d[axis])) axis = a;
+        }
+
+        LinearBVHNode node;
+        node.bounds = bounds[subset];
+        node.childOffset = pair;
+        node.numPrimitives = 0;
+        node.axis = static_cast<uint8_t>(axis);
+        node.pad[0] = 0;
+        m_Nodes[nodeIndex] = node;
+
+        stack[stackSize][0] = part;
+        stack[stackSize++][1] = pair;
+        stack[stackSize][0] = subset ^ part;
+        stack[stackSize++][1] = pair + 1;
+    }
+
+    return true;
+}
+
+// Turns every topmost subtree that is cheaper as a single leaf into one. Gathers the
+// objects depth-first, which also makes the objects of every leaf contiguous again
+// after the treelets moved them around. Nodes below a collapsed one are left
+// unreachable; layoutNodes() drops them.
+void BVHAccel::collapseLeaves(const TreeletCosts& costs)
+{
+    std::vector<int32_t> primitives;
+    primitives.reserve(m_PrimitiveIndices.size());
+
+    std::vector<int> toVisit(1, 0);
+    std::vector<int> subtree;
+    while (!toVisit.empty())
+    {
+        int            nodeIndex = toVisit.back();
+        LinearBVHNode& node = m_Nodes[nodeIndex];
+        toVisit.pop_back();
+
+        if (!node.IsLeaf())
+        {
+            Float area = node.bounds.SurfaceArea();
+            Float interiorCost = m_Options.traversalCost * area +
+                                 costs.cost[node.childOffset] +
+                                 costs.cost[node.childOffset + 1];
+            int numPrimitives = costs.numPrimitives[nodeIndex];
+            if (leafCost(numPrimitives, node.bounds) > interiorCost)
+            {
+                toVisit.push_back(node.childOffset + 1);
+                toVisit.push_back(node.childOffset);
+                continue;
+            }
+
+            // Collect the objects of all leaves below
+            int first = static_cast<int>(primitives.size());
+            subtree.assign(1, node.childOffset + 1);
+            subtree.push_back(node.childOffset);
+            while (!subtree.empty())
+            {
+                const LinearBVHNode& below = m_Nodes[subtree.back()];
+                subtree.pop_back();
+                if (below.IsLeaf())
+                {
+                    auto begin = m_PrimitiveIndices.begin() + below.primitivesOffset;
+                    primitives.insert(primitives.end(), begin, begin + below.numPrimitives);
+                }
+                else
+                {
+                    subtree.push_back(below.childOffset + 1);
+                    subtree.push_back(below.childOffset);
+                }
+            }
+
+            node.primitivesOffset = first;
+            node.numPrimitives = static_cast<uint16_t>(numPrimitives);
+            continue;
+        }
+
+        auto begin = m_PrimitiveIndices.begin() + node.primitivesOffset;
+        node.primitivesOffset = static_cast<int32_t>(primitives.size());
+        primitives.insert(primitives.end(), begin, begin + node.numPrimitives);
+    }
+
+    m_PrimitiveIndices.swap(primitives);
+}
@@ -5,35 +5,184 @@
 #ifndef SRC_CORE_BVH_H_
 #define SRC_CORE_BVH_H_
 
+#include <cstdint>
+#include <string>
+
 #include "geometry.h"
 #include "hittable.h"
+#include "primitiveset.h"
 
 // Forward Declarations
 class Scene;
 class MeshTriangle;
+class BVHCache;
 struct BVHNode;
+struct BVHBuildRefs;
+struct BVHBuildPrims;
+struct SAHSplit;
+struct SpatialSplit;
+struct TreeletCosts;
+struct MortonPrimitive;
+template <int N>
+class WideBVH;
+
+// BVH Build Options
+struct BVHBuildOptions
+{
+    enum SplitMethod
+    {
+        Median,  // split at the median centroid along the axis of max extent
+        SAH,     // binned surface area heuristic
+        SBVH,    // SAH plus spatial splits that clip large, overlapping objects
+        LBVH     // sorted Morton codes of the centroids, fast but lower quality
+    };
+
+    BVHBuildOptions()
+        : splitMethod(SAH),
+          maxLeafSize(4),
+          numBins(16),
+          traversalCost(1.f),
+          leafCost(1.f),
+          width(4),
+          splitBudget(0.3f),
+          quantized(false),
+          optimizePasses(0),
+          packLeaves(true),
+          cacheDir()
+    {
+    }
+
+    SplitMethod splitMethod;
+    int         maxLeafSize;    // max #primitives in a leaf
+    int         numBins;        // SAH only
+    Float       traversalCost;  // cost of visiting an interior node
+    Float       leafCost;       // cost of intersecting one primitive in a leaf
+    int         width;          // children per node for traversal: 2, 4 or 8
+    Float       splitBudget;    // SBVH only: max duplicated references per object
+    bool        quantized;      // width 4 and 8 only: 8-bit child bounds
+    int         optimizePasses; // treelet restructuring passes after the build
+    bool        packLeaves;     // keep a copy of the primitives in leaf order, see below
+    std::string cacheDir;       // if set, mesh BVHs are loaded from and saved to here
+
+    // LBVH only uses maxLeafSize; the costs are still used to report SAHCost()
+    // packLeaves only applies to sets that support it (MeshTriangle, 36 bytes per
+    // triangle reference), see PrimitiveSet::PackLeaves()
+};
+
+// Linear BVH Node (32 bytes)
+// Interior nodes store their two children next to each other at childOffset and
+// childOffset + 1. Leaves store a range of BVHAccel's primitive array.
+struct LinearBVHNode
+{
+    Bounds3 bounds;
+    union
+    {
+        int32_t primitivesOffset;  // leaf
+        int32_t childOffset;       // interior
+    };
+    uint16_t numPrimitives;  // 0 -> interior node
+    uint8_t  axis;           // interior node: split axis
+    uint8_t  pad[1];         // ensure 32 byte total size
+
+    bool IsLeaf() const { return numPrimitives > 0; }
+};
+
+#ifndef FLOAT_AS_DOUBLE
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should be 32 bytes");
+#endif
 
 class BVHAccel : public Hittable
 {
 public:
     // Constructors
-    explicit BVHAccel(const Scene& scene);
-    explicit BVHAccel(const MeshTriangle& meshTriangle);
-    explicit BVHAccel(const std::vector<std::shared_ptr<Hittable>>& objects);
+    explicit BVHAccel(const Scene&           scene,
+                      const BVHBuildOptions& options = BVHBuildOptions());
+    explicit BVHAccel(const MeshTriangle&    meshTriangle,
+                      const BVHBuildOptions& options = BVHBuildOptions());
+    explicit BVHAccel(const std::vector<std::shared_ptr<Hittable>>& objects,
+                      const BVHBuildOptions& options = BVHBuildOptions());
+    // The set is referenced, not copied, and has to outlive the BVH
+    explicit BVHAccel(const PrimitiveSet&    primitives,
+                      const BVHBuildOptions& options = BVHBuildOptions());
+    ~BVHAccel();
 
     // Public Methods
-    bool Hit(const Ray& ray, Float tMin, Float tMax, HitRecord& hitRecord) const override;
+    bool Intersect(const Ray& ray, Float tMin, Float tMax, RayHit& hit) const override;
+    void ComputeHitRecord(const Ray& ray, const RayHit& hit,
+                          HitRecord& hitRecord) const override;
+    bool Occluded(const Ray& ray, Float tMin, Float tMax) const override;
     Bounds3 WorldBound() const override;
 
+    // Packets traverse the binary tree together, whatever the width: a node is
+    // entered with the rays that hit it and visited once for all of them
+    uint32_t IntersectPacket(const RayPacket& packet, uint32_t activeMask, Float tMin,
+                             Float tMax[], RayHit hits[]) const override;
+    uint32_t OccludedPacket(const RayPacket& packet, uint32_t activeMask, Float tMin,
+                            const Float tMax[]) const override;
+
+    // Expected cost of a random ray under the surface area heuristic
+    Float SAHCost() const;
+
+    // Recomputes the bounds bottom-up after the objects moved, keeping the tree as
+    // is. Rebuilds instead once the SAH cost grows past maxCostRatio times the cost
+    // of the last build. Returns true if it rebuilt.
+    bool Refit(Float maxCostRatio = 1.5f);
+
     // Private Methods
-    std::shared_ptr<BVHNode> recursiveBuild(
-        std::vector<std::shared_ptr<Hittable>> objects);
+    std::shared_ptr<BVHNode> recursiveBuild(BVHBuildRefs refs, int depth, int splitBudget);
+
+    // Traversal stack size. The builder keeps the tree shallower than this.
+    static const int MaxDepth = 64;
 
 private:
-    std::shared_ptr<BVHNode>               m_Root;
-    std::vector<std::shared_ptr<Hittable>> m_Objects;
+    BVHBuildOptions               m_Options;
+    std::vector<LinearBVHNode>    m_Nodes;  // root at 0, siblings adjacent
+    const PrimitiveSet*           m_Primitives;
+    std::unique_ptr<PrimitiveSet> m_OwnedPrimitives;   // objects passed by value
+    std::vector<int32_t>          m_PrimitiveIndices;  // into m_Primitives, leaf order
+    std::vector<Float>            m_PackedLeaves;      // see PrimitiveSet::PackLeaves()
+
+    // Collapsed copies of m_Nodes used for traversal if options.width is 4 or 8
+    std::unique_ptr<WideBVH<4>> m_BVH4;
+    std::unique_ptr<WideBVH<8>> m_BVH8;
 
-    bool getHitRecord(std::shared_ptr<BVHNode> node, const Ray& ray, Float tMin, Float tMax, HitRecord& hitRecord) const;
+    Float m_RootSurfaceArea;  // SBVH build only
+    Float m_BuildSAHCost;
+
+    explicit BVHAccel(const BVHBuildOptions& options);
+
+    void build();
+    bool loadCache(const BVHCache& cache);
+    void saveCache(const BVHCache& cache) const;
+    void buildWideBVH();
+    void packLeaves();
+    void refitNode(int nodeIndex);
+
+    void buildObjects(BVHBuildPrims& prims, int begin, int end, int depth, int nodeIndex);
+    int  partitionIndices(BVHBuildPrims& prims, int begin, int end,
+                          const SAHSplit& split) const;
+    template <typename Refs>
+    bool splitSAH(const Refs& refs, const Bounds3& bounds, const Bounds3& centroidBounds,
+                  SAHSplit& split) const;
+    void buildLBVH(BVHBuildPrims& prims);
+    void emitLBVH(BVHBuildPrims& prims, const MortonPrimitive* mortonPrims, int begin,
+                  int end, int bitIndex, int nodeIndex);
+    bool splitSpatial(const BVHBuildRefs& refs, const Bounds3& bounds, int splitBudget,
+                      SpatialSplit& split) const;
+    void partitionObjects(BVHBuildRefs& refs, const std::vector<uint8_t>& goesLeft,
+                          BVHBuildRefs& leftRefs, BVHBuildRefs& rightRefs) const;
+    void partitionSpatial(BVHBuildRefs& refs, const SpatialSplit& split,
+                          BVHBuildRefs& leftRefs, BVHBuildRefs& rightRefs) const;
+    void buildChildren(BVHNode& node, BVHBuildRefs leftRefs, BVHBuildRefs rightRefs,
+                       int depth, int leftBudget, int rightBudget);
+    void flatten(const BVHNode& node, int nodeIndex);
+    void layoutNodes();
+
+    std::vector<int> nodesByLevel(std::vector<int>& levelOffset) const;
+    void             optimizeTreelets();
+    Float            leafCost(int numPrimitives, const Bounds3& bounds) const;
+    bool restructureTreelet(int rootIndex, int rootDepth, TreeletCosts& costs);
+    void             collapseLeaves(const TreeletCosts& costs);
 };
 
 // BVHNode
@@ -41,13 +190,16 @@ struct BVHNode
 {
 public:
     // Public Methods
-    BVHNode() : bounds(), left(nullptr), right(nullptr), object(nullptr) { }
+    BVHNode() : bounds(), left(nullptr), right(nullptr), primitives(), axis(0) { }
+
+    bool IsLeaf() const { return !primitives.empty(); }
 
     // Public Data
-    Bounds3                   bounds;
-    std::shared_ptr<BVHNode>  left;
-    std::shared_ptr<BVHNode>  right;
-    std::shared_ptr<Hittable> object;
+    Bounds3                  bounds;
+    std::shared_ptr<BVHNode> left;
+    std::shared_ptr<BVHNode> right;
+    std::vector<int32_t>     primitives;  // leaf, indices into the primitive set
+    int                      axis;
 };
 
 // class BVHNode : public Hittable
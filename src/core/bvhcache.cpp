@@ -0,0 +1,328 @@
+//
+// Created by Junhao Wang (@Forkercat) on 2021/5/27.
+//
+
+#include "bvhcache.h"
+
+#include <spdlog/spdlog.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <type_traits>
+
+#include "triangle.h"
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+const char CacheMagic[8] = { 'F', 'K', 'R', 'B', 'V', 'H', '\0', '\0' };
+
+// File Header (48 bytes), followed by the nodes and the primitive indices
+struct CacheHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t nodeSize;  // sizeof(CacheNode), which differs with FLOAT_AS_DOUBLE
+    uint64_t key;
+    uint32_t numNodes;
+    uint32_t numPrimitives;  // leaf slots; spatial splits may repeat a triangle
+    uint32_t numTriangles;
+    uint32_t pad[3];
+};
+
+static_assert(sizeof(CacheHeader) == 48, "CacheHeader should be 48 bytes");
+
+// File Node, the same 32 bytes as LinearBVHNode. LinearBVHNode is not trivially
+// copyable in debug builds (Vector3 checks for NaNs when copied), so nodes go
+// through this record field by field instead of being copied as raw bytes.
+struct CacheNode
+{
+    Float    bounds[6];  // pMin, pMax
+    int32_t  offset;     // primitivesOffset or childOffset
+    uint16_t numPrimitives;
+    uint8_t  axis;
+    uint8_t  pad[1];
+};
+
+static_assert(std::is_trivially_copyable<CacheNode>::value,
+              "CacheNode is copied as raw bytes");
+
+CacheNode ToCacheNode(const LinearBVHNode& node)
+{
+    CacheNode cacheNode;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        cacheNode.bounds[axis] = node.bounds.pMin[axis];
+        cacheNode.bounds[3 + axis] = node.bounds.pMax[axis];
+    }
+    cacheNode.offset = node.primitivesOffset;
+    cacheNode.numPrimitives = node.numPrimitives;
+    cacheNode.axis = node.axis;
+    cacheNode.pad[0] = 0;
+    return cacheNode;
+}
+
+LinearBVHNode FromCacheNode(const CacheNode& cacheNode)
+{
+    LinearBVHNode node;
+    const Float* b = cacheNode.bounds;
+    node.bounds.pMin = Point3f(b[0], b[1], b[2]);
+    node.bounds.pMax = Point3f(b[3], b[4], b[5]);
+    node.primitivesOffset = cacheNode.offset;
+    node.numPrimitives = cacheNode.numPrimitives;
+    node.axis = cacheNode.axis;
+    node.pad[0] = 0;
+    return node;
+}
+
+// 64-bit FNV-1a
+class Hasher
+{
+public:
+    void Add(const void* data, size_t size)
+    {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; ++i)
+        {
+            m_Hash = (m_Hash ^ bytes[i]) * 0x100000001b3ull;
+        }
+    }
+
+    template <typename T>
+    void Add(const T& value)
+    {
+        Add(&value, sizeof(T));
+    }
+
+    uint64_t Hash() const { return m_Hash; }
+
+private:
+    uint64_t m_Hash = 0xcbf29ce484222325ull;
+};
+
+// Read-only view of a whole file. Uses mmap where available, so nothing but the
+// pages that are touched gets read.
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& path) : m_Data(nullptr), m_Size(0)
+    {
+#ifdef _WIN32
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file) return;
+
+        m_Buffer.resize(static_cast<size_t>(file.tellg()));
+        file.seekg(0);
+        if (!file.read(m_Buffer.data(), m_Buffer.size())) return;
+
+        m_Data = m_Buffer.data();
+        m_Size = m_Buffer.size();
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED)
+            {
+                m_Data = static_cast<const char*>(data);
+                m_Size = static_cast<size_t>(st.st_size);
+            }
+        }
+        close(fd);  // the mapping stays valid
+#endif
+    }
+
+    ~MappedFile()
+    {
+#ifndef _WIN32
+        if (m_Data) munmap(const_cast<char*>(m_Data), m_Size);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* Data() const { return m_Data; }
+    size_t      Size() const { return m_Size; }
+
+private:
+    const char* m_Data;
+    size_t      m_Size;
+#ifdef _WIN32
+    std::vector<char> m_Buffer;
+#endif
+};
+
+int ProcessId()
+{
+#ifdef _WIN32
+    return _getpid();
+#else
+    return static_cast<int>(getpid());
+#endif
+}
+}  // namespace
+
+const uint32_t BVHCache::Version;
+
+// Constructor
+BVHCache::BVHCache(const std::string& cacheDir, const MeshTriangle& meshTriangle,
+                   const BVHBuildOptions& options)
+    : m_Key(0), m_Path()
+{
+    // Only what changes the built tree goes into the key. The width is not part of
+    // it: wide BVHs are collapsed from the cached binary nodes.
+    Hasher hasher;
+    hasher.Add(Version);
+    hasher.Add(sizeof(Float));
+    hasher.Add(static_cast<int>(options.splitMethod));
+    hasher.Add(options.maxLeafSize);
+    hasher.Add(options.numBins);
+    hasher.Add(options.traversalCost);
+    hasher.Add(options.leafCost);
+    hasher.Add(options.splitBudget);
+    hasher.Add(options.optimizePasses);
+
+    int numTriangles = meshTriangle.NumTriangles();
+    hasher.Add(numTriangles);
+    for (int i = 0; i < numTriangles; ++i)
+    {
+        Point3f p0, p1, p2;
+        meshTriangle.GetPositions(i, p0, p1, p2);
+        hasher.Add(p0);
+        hasher.Add(p1);
+        hasher.Add(p2);
+    }
+    m_Key = hasher.Hash();
+
+    char fileName[32];
+    std::snprintf(fileName, sizeof(fileName), "%016llx.bvh",
+                  static_cast<unsigned long long>(m_Key));
+    m_Path = cacheDir.empty() ? fileName : cacheDir + "/" + fileName;
+}
+
+// Public Methods
+bool BVHCache::Load(int numTriangles, std::vector<LinearBVHNode>& nodes,
+                    std::vector<int32_t>& primitiveIndices) const
+{
+    MappedFile file(m_Path);
+    if (!file.Data() || file.Size() < sizeof(CacheHeader)) return false;
+
+    CacheHeader header;
+    std::memcpy(&header, file.Data(), sizeof(header));
+
+    if (std::memcmp(header.magic, CacheMagic, sizeof(CacheMagic)) != 0 ||
+        header.version != Version || header.nodeSize != sizeof(CacheNode) ||
+        header.key != m_Key || header.numNodes == 0 ||
+        header.numTriangles != static_cast<uint32_t>(numTriangles))
+    {
+        spdlog::warn("[BVHCache] Ignoring incompatible cache file {}", m_Path);
+        return false;
+    }
+
+    size_t nodesSize = static_cast<size_t>(header.numNodes) * sizeof(CacheNode);
+    size_t indicesSize = static_cast<size_t>(header.numPrimitives) * sizeof(int32_t);
+    if (file.Size() != sizeof(CacheHeader) + nodesSize + indicesSize)
+    {
+        spdlog::warn("[BVHCache] Ignoring truncated cache file {}", m_Path);
+        return false;
+    }
+
+    const char* nodesData = file.Data() + sizeof(CacheHeader);
+    nodes.resize(header.numNodes);
+    for (uint32_t i = 0; i < header.numNodes; ++i)
+    {
+        CacheNode cacheNode;
+        std::memcpy(&cacheNode, nodesData + i * sizeof(CacheNode), sizeof(CacheNode));
+        nodes[i] = FromCacheNode(cacheNode);
+    }
+    primitiveIndices.resize(header.numPrimitives);
+    std::memcpy(primitiveIndices.data(), nodesData + nodesSize, indicesSize);
+
+    // Traversal trusts the offsets, so check them once. Children always come after
+    // their parent, which also rules out cycles.
+    int numNodes = static_cast<int>(header.numNodes);
+    int numPrimitives = static_cast<int>(header.numPrimitives);
+    bool valid = true;
+    for (int i = 0; i < numNodes && valid; ++i)
+    {
+        const LinearBVHNode& node = nodes[i];
+        if (node.IsLeaf())
+            valid = node.primitivesOffset >= 0 &&
+                    node.primitivesOffset + node.numPrimitives <= numPrimitives;
+        else
+            valid = node.childOffset > i && node.childOffset + 1 < numNodes;
+    }
+    for (int i = 0; i < numPrimitives && valid; ++i)
+    {
+        valid = primitiveIndices[i] >= 0 && primitiveIndices[i] < numTriangles;
+    }
+
+    if (!valid)
+    {
+        spdlog::warn("[BVHCache] Ignoring corrupted cache file {}", m_Path);
+        nodes.clear();
+        primitiveIndices.clear();
+        return false;
+    }
+
+    return true;
+}
+
+bool BVHCache::Save(int numTriangles, const std::vector<LinearBVHNode>& nodes,
+                    const std::vector<int32_t>& primitiveIndices) const
+{
+    static std::atomic<int> counter(0);
+
+    CacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, CacheMagic, sizeof(CacheMagic));
+    header.version = Version;
+    header.nodeSize = sizeof(CacheNode);
+    header.key = m_Key;
+    header.numNodes = static_cast<uint32_t>(nodes.size());
+    header.numPrimitives = static_cast<uint32_t>(primitiveIndices.size());
+    header.numTriangles = static_cast<uint32_t>(numTriangles);
+
+    std::string tempPath =
+        m_Path + ".tmp" + std::to_string(ProcessId()) + "_" + std::to_string(counter++);
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (const LinearBVHNode& node : nodes)
+        {
+            CacheNode cacheNode = ToCacheNode(node);
+            file.write(reinterpret_cast<const char*>(&cacheNode), sizeof(cacheNode));
+        }
+        file.write(reinterpret_cast<const char*>(primitiveIndices.data()),
+                   primitiveIndices.size() * sizeof(int32_t));
+        if (!file)
+        {
+            spdlog::warn("[BVHCache] Failed to write {}", tempPath);
+            std::remove(tempPath.c_str());
+            return false;
+        }
+    }
+
+    // Another run may have written the same file meanwhile; either copy will do
+    if (std::rename(tempPath.c_str(), m_Path.c_str()) != 0)
+    {
+        std::remove(tempPath.c_str());
+        return false;
+    }
+
+    return true;
+}
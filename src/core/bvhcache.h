@@ -0,0 +1,50 @@
+//
+// Created by Junhao Wang (@Forkercat) on 2021/5/27.
+//
+
+#ifndef SRC_CORE_BVHCACHE_H_
+#define SRC_CORE_BVHCACHE_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "bvh.h"
+
+// BVH Cache
+// Flattened mesh BVHs stored on disk, so that repeated runs over the same assets skip
+// the build. A file holds a header, the LinearBVHNode array and, for every primitive
+// slot of the leaves, the index of the mesh triangle it refers to. Files are named
+// after a hash of the triangle vertices and the build options; the header repeats
+// the hash and a format version, so stale or foreign files are ignored.
+class BVHCache
+{
+public:
+    // Constructor
+    BVHCache(const std::string& cacheDir, const MeshTriangle& meshTriangle,
+             const BVHBuildOptions& options);
+
+    // Public Methods
+    // Maps the file and copies the nodes out in one go. Returns false if there is no
+    // valid file for this key.
+    bool Load(int numTriangles, std::vector<LinearBVHNode>& nodes,
+              std::vector<int32_t>& primitiveIndices) const;
+
+    // Writes to a temporary file first, so that concurrent runs never read a partial
+    // file
+    bool Save(int numTriangles, const std::vector<LinearBVHNode>& nodes,
+              const std::vector<int32_t>& primitiveIndices) const;
+
+    uint64_t           Key() const { return m_Key; }
+    const std::string& Path() const { return m_Path; }
+
+    // Bump whenever the file layout or the builders' output changes
+    static const uint32_t Version = 3;
+
+private:
+    // Private Data
+    uint64_t    m_Key;
+    std::string m_Path;
+};
+
+#endif  // SRC_CORE_BVHCACHE_H_
@@ -8,14 +8,19 @@
 #include "bounds.h"
 #include "bvh.h"
 #include "camera.h"
+#include "film.h"
 #include "hittable.h"
+#include "instance.h"
 #include "loader.h"
 #include "material.h"
 #include "plane.h"
+#include "primitiveset.h"
 #include "ray.h"
 #include "scene.h"
+#include "scheduler.h"
 #include "sphere.h"
 #include "texture.h"
+#include "threadpool.h"
 #include "tgaimage.h"
 #include "triangle.h"
 
@@ -0,0 +1,24 @@
+//
+// Created by Junhao Wang (@Forkercat) on 2021/5/20.
+//
+
+#include "film.h"
+
+// Constructor
+Film::Film(int width, int height)
+    : m_Width(width), m_Height(height), m_Pixels(width * height, Color3(0.f))
+{
+}
+
+void Film::WritePPM(std::ostream& out, int samplesPerPixel) const
+{
+    out << "P3\n" << m_Width << ' ' << m_Height << "\n255\n";
+
+    for (int j = m_Height - 1; j >= 0; --j)
+    {
+        for (int i = 0; i < m_Width; ++i)
+        {
+            WriteColor(out, GetPixel(i, j), samplesPerPixel);
+        }
+    }
+}
@@ -0,0 +1,41 @@
+//
+// Created by Junhao Wang (@Forkercat) on 2021/5/20.
+//
+
+#ifndef SRC_CORE_FILM_H_
+#define SRC_CORE_FILM_H_
+
+#include <iostream>
+#include <vector>
+
+#include "common.h"
+
+// Film accumulates radiance for every pixel of the image. Each pixel belongs to
+// exactly one tile, so workers can write to it without synchronization.
+class Film
+{
+public:
+    // Constructor
+    Film(int width, int height);
+
+    int Width() const { return m_Width; }
+    int Height() const { return m_Height; }
+
+    void AddSample(int x, int y, const Color3& color)
+    {
+        DCHECK(x >= 0 && x < m_Width && y >= 0 && y < m_Height);
+        m_Pixels[y * m_Width + x] += color;
+    }
+
+    const Color3& GetPixel(int x, int y) const { return m_Pixels[y * m_Width + x]; }
+
+    // Writes a PPM (P3) image, top row first
+    void WritePPM(std::ostream& out, int samplesPerPixel) const;
+
+private:
+    int                 m_Width;
+    int                 m_Height;
+    std::vector<Color3> m_Pixels;
+};
+
+#endif  // SRC_CORE_FILM_H_
@@ -11,18 +11,49 @@
 #include "bounds.h"
 #include "constant.h"
 #include "ray.h"
+#include "raypacket.h"
 
 class Material;
 
 // Hit Structs
+// Closest hit found during traversal: just enough to compare hits and to come back to
+// the primitive later. The shading attributes of the final hit go into a HitRecord.
+//
+// Object sets nest (an object BVH inside a scene, an instance of a scene), so every set
+// keeps the index of its hit object in the slot of its own nesting level.
+struct RayHit
+{
+    static const int MaxObjectDepth = 4;
+
+    Float   t;
+    Float   u, v;                     // barycentric coordinates (triangles)
+    int32_t objects[MaxObjectDepth];  // index of the object hit in each nested set
+    int32_t primitive;  // index of the primitive within the object, e.g. a triangle
+    int32_t depth;      // nesting level of the object set being traversed
+
+    RayHit() : t(Infinity), u(0.f), v(0.f), primitive(-1), depth(0)
+    {
+        for (int32_t& object : objects) object = -1;
+    }
+
+    // An object set takes the returned level's slot before it goes through its
+    // objects, so the sets nested in them take the deeper ones, and leaves it after
+    inline int EnterObjectSet()
+    {
+        DCHECK_LT(depth, MaxObjectDepth);
+        return depth++;
+    }
+    inline void LeaveObjectSet() { --depth; }
+};
+
 struct HitRecord
 {
-    Point3f                   p;
-    Vector3f                  normal;
-    Float                     t;
-    Vector2f                  texCoord;
-    bool                      frontFace;
-    std::shared_ptr<Material> material;
+    Point3f         p;
+    Vector3f        normal;
+    Float           t;
+    Vector2f        texCoord;
+    bool            frontFace;
+    const Material* material;  // owned by the object that was hit
 
     HitRecord()
         : p(0.f), normal(0.f), t(Infinity), texCoord(), frontFace(false), material(nullptr) { }
@@ -38,10 +69,89 @@ struct HitRecord
 class Hittable
 {
 public:
-    virtual bool    Hit(const Ray& ray, Float tMin, Float tMax,
-                        HitRecord& hitRecord) const = 0;
+    // Closest hit in (tMin, tMax) with all shading attributes
+    bool Hit(const Ray& ray, Float tMin, Float tMax, HitRecord& hitRecord) const
+    {
+        RayHit hit;
+        if (!Intersect(ray, tMin, tMax, hit)) return false;
+
+        ComputeHitRecord(ray, hit, hitRecord);
+        return true;
+    }
+
+    // Closest hit in (tMin, tMax) without shading attributes. Leaves hit as it is on
+    // a miss, so callers can keep the closest hit of several objects in one RayHit.
+    virtual bool Intersect(const Ray& ray, Float tMin, Float tMax, RayHit& hit) const = 0;
+    // Fills in the surface interaction of a hit that Intersect() found for this ray.
+    // Run once for the final hit instead of for every closer candidate.
+    virtual void ComputeHitRecord(const Ray& ray, const RayHit& hit,
+                                  HitRecord& hitRecord) const = 0;
+
+    // Any-hit query (e.g. shadow rays): stops at the first hit in (tMin, tMax)
+    // and skips all shading attributes
+    virtual bool    Occluded(const Ray& ray, Float tMin, Float tMax) const = 0;
     virtual Bounds3 WorldBound() const = 0;
+    // Splits the part of the object inside bounds at the plane axis = position. Used
+    // by spatial-split BVH builds; the default splits the box itself.
+    virtual void    SplitBound(const Bounds3& bounds, int axis, Float position,
+                               Bounds3& left, Bounds3& right) const
+    {
+        left = right = bounds;
+        left.pMax[axis] = std::min(left.pMax[axis], position);
+        right.pMin[axis] = std::max(right.pMin[axis], position);
+    }
     virtual void ApplyTransform(const Vector3f& translate, const Vector3f& rotate, Float scale) { }
+
+    // Packet queries over the rays in activeMask. IntersectPacket lowers tMax[i] and
+    // fills hits[i] for every ray i with a closer hit and returns the mask of those
+    // rays; HitPacket does the same and then computes their hit records.
+    // OccludedPacket returns the mask of occluded rays. The defaults trace the rays one
+    // by one.
+    uint32_t HitPacket(const RayPacket& packet, uint32_t activeMask, Float tMin,
+                       Float tMax[], HitRecord hitRecords[]) const
+    {
+        RayHit   hits[RayPacket::MaxSize];
+        uint32_t hitMask = IntersectPacket(packet, activeMask, tMin, tMax, hits);
+        for (int i = 0; i < packet.size; ++i)
+        {
+            if (hitMask & (1u << i))
+            {
+                ComputeHitRecord(packet.rays[i], hits[i], hitRecords[i]);
+            }
+        }
+        return hitMask;
+    }
+
+    virtual uint32_t IntersectPacket(const RayPacket& packet, uint32_t activeMask,
+                                     Float tMin, Float tMax[], RayHit hits[]) const
+    {
+        uint32_t hitMask = 0;
+        for (int i = 0; i < packet.size; ++i)
+        {
+            if (!(activeMask & (1u << i))) continue;
+
+            if (Intersect(packet.rays[i], tMin, tMax[i], hits[i]))
+            {
+                hitMask |= 1u << i;
+                tMax[i] = hits[i].t;
+            }
+        }
+        return hitMask;
+    }
+
+    virtual uint32_t OccludedPacket(const RayPacket& packet, uint32_t activeMask,
+                                    Float tMin, const Float tMax[]) const
+    {
+        uint32_t occludedMask = 0;
+        for (int i = 0; i < packet.size; ++i)
+        {
+            if ((activeMask & (1u << i)) && Occluded(packet.rays[i], tMin, tMax[i]))
+            {
+                occludedMask |= 1u << i;
+            }
+        }
+        return occludedMask;
+    }
 };
 
 #endif  // CORE_HITTABLE_H_
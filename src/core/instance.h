@@ -0,0 +1,162 @@
+//
+// Created by Junhao Wang (@Forkercat) on 2021/5/26.
+//
+
+#ifndef SRC_CORE_INSTANCE_H_
+#define SRC_CORE_INSTANCE_H_
+
+#include <cmath>
+#include <memory>
+
+#include "hittable.h"
+#include "transform.h"
+
+// Instance places a shared object (typically a MeshTriangle with its own BVH) in the
+// scene with an affine transform. Rays are moved into object space instead of the
+// geometry into world space, so N instances cost one copy of the object and one BVH
+// build. Added to a Scene, the scene BVH becomes the top level over all instances.
+class Instance : public Hittable
+{
+public:
+    // Constructor
+    Instance(const std::shared_ptr<Hittable>& object,
+             const AffineTransform&           objectToWorld)
+        : m_Object(object),
+          m_ObjectToWorld(objectToWorld),
+          m_WorldToObject(objectToWorld.Inverse()),
+          m_VolumeScale(std::abs(objectToWorld.Determinant()))
+    {
+    }
+
+    // hit.t is in world space; the rest of hit is the object's own
+    bool Intersect(const Ray& ray, Float tMin, Float tMax, RayHit& hit) const override;
+    void ComputeHitRecord(const Ray& ray, const RayHit& hit,
+                          HitRecord& hitRecord) const override;
+    bool Occluded(const Ray& ray, Float tMin, Float tMax) const override;
+
+    // The packet moves into object space as a whole and stays coherent there
+    uint32_t IntersectPacket(const RayPacket& packet, uint32_t activeMask, Float tMin,
+                             Float tMax[], RayHit hits[]) const override;
+    uint32_t OccludedPacket(const RayPacket& packet, uint32_t activeMask, Float tMin,
+                            const Float tMax[]) const override;
+
+    // Composes with the current transform; the shared object is left untouched
+    void ApplyTransform(const Vector3f& translate, const Vector3f& rotate,
+                        Float scale) override
+    {
+        AffineTransform trs = AffineTransform::FromTRS(translate, rotate, scale);
+        m_ObjectToWorld = trs * m_ObjectToWorld;
+        m_WorldToObject = m_ObjectToWorld.Inverse();
+        m_VolumeScale = std::abs(m_ObjectToWorld.Determinant());
+    }
+
+    // From the object's current bound, since the shared object may move on its own
+    Bounds3 WorldBound() const override
+    {
+        Bounds3 objectBound = m_Object->WorldBound();
+        Bounds3 worldBound;
+        for (int corner = 0; corner < 8; ++corner)
+        {
+            Point3f p(objectBound[corner & 1].x, objectBound[(corner >> 1) & 1].y,
+                      objectBound[corner >> 2].z);
+            worldBound = Union(worldBound, m_ObjectToWorld.ApplyPoint(p));
+        }
+        return worldBound;
+    }
+
+    const std::shared_ptr<Hittable>& GetObject() const { return m_Object; }
+    const AffineTransform&           GetTransform() const { return m_ObjectToWorld; }
+
+private:
+    // The triangle's parallel test compares dot(dir, cross(e1, e2)) against an
+    // absolute epsilon. Stretching the object space direction by the determinant
+    // keeps that product the same as for baked geometry (exactly for uniform scales).
+    // Object space t equals world space t times tScale.
+    Ray toObject(const Ray& ray, Float& tScale) const
+    {
+        tScale = 1.f / m_VolumeScale;
+        return Ray(m_WorldToObject.ApplyPoint(ray.origin),
+                   m_WorldToObject.ApplyVector(ray.dir) * m_VolumeScale);
+    }
+
+    RayPacket toObject(const RayPacket& packet, const Float tMax[], Float& tScale,
+                       Float objectTMax[]) const
+    {
+        RayPacket objectPacket;
+        tScale = 1.f / m_VolumeScale;
+        for (int i = 0; i < packet.size; ++i)
+        {
+            objectPacket.Add(toObject(packet.rays[i], tScale));
+            objectTMax[i] = tMax[i] * tScale;
+        }
+        return objectPacket;
+    }
+
+    // Private Data
+    std::shared_ptr<Hittable> m_Object;
+    AffineTransform           m_ObjectToWorld;
+    AffineTransform           m_WorldToObject;
+    Float                     m_VolumeScale;  // |det| of objectToWorld
+};
+
+inline bool Instance::Intersect(const Ray& ray, Float tMin, Float tMax, RayHit& hit) const
+{
+    Float tScale;
+    Ray   objectRay = toObject(ray, tScale);
+    if (!m_Object->Intersect(objectRay, tMin * tScale, tMax * tScale, hit)) return false;
+
+    hit.t /= tScale;
+    return true;
+}
+
+inline void Instance::ComputeHitRecord(const Ray& ray, const RayHit& hit,
+                                       HitRecord& hitRecord) const
+{
+    Float  tScale;
+    Ray    objectRay = toObject(ray, tScale);
+    RayHit objectHit = hit;
+    objectHit.t *= tScale;
+    m_Object->ComputeHitRecord(objectRay, objectHit, hitRecord);
+
+    // Back to world space. The normal keeps its side, so frontFace still holds.
+    hitRecord.t = hit.t;
+    hitRecord.p = ray(hitRecord.t);
+    hitRecord.normal = Normalize(m_ObjectToWorld.ApplyNormal(hitRecord.normal));
+}
+
+inline bool Instance::Occluded(const Ray& ray, Float tMin, Float tMax) const
+{
+    Float tScale;
+    Ray   objectRay = toObject(ray, tScale);
+    return m_Object->Occluded(objectRay, tMin * tScale, tMax * tScale);
+}
+
+inline uint32_t Instance::IntersectPacket(const RayPacket& packet, uint32_t activeMask,
+                                          Float tMin, Float tMax[], RayHit hits[]) const
+{
+    Float     tScale;
+    Float     objectTMax[RayPacket::MaxSize];
+    RayPacket objectPacket = toObject(packet, tMax, tScale, objectTMax);
+
+    uint32_t hitMask = m_Object->IntersectPacket(objectPacket, activeMask, tMin * tScale,
+                                                 objectTMax, hits);
+    for (int i = 0; i < packet.size; ++i)
+    {
+        if (!(hitMask & (1u << i))) continue;
+
+        hits[i].t /= tScale;
+        tMax[i] = hits[i].t;
+    }
+    return hitMask;
+}
+
+inline uint32_t Instance::OccludedPacket(const RayPacket& packet, uint32_t activeMask,
+                                         Float tMin, const Float tMax[]) const
+{
+    Float     tScale;
+    Float     objectTMax[RayPacket::MaxSize];
+    RayPacket objectPacket = toObject(packet, tMax, tScale, objectTMax);
+    return m_Object->OccludedPacket(objectPacket, activeMask, tMin * tScale, objectTMax);
+}
+
+#endif  // SRC_CORE_INSTANCE_H_
@@ -7,6 +7,7 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 
 #include "material.h"
 #include "tgaimage.h"
@@ -21,6 +22,17 @@ std::string ltrim(const std::string& s)
     return (start == std::string::npos) ? "" : s.substr(start);
 }
 
+// Hash of a face corner's (position, texCoord, normal) indices
+struct VertexKeyHash
+{
+    size_t operator()(const Vector3i& key) const
+    {
+        return (static_cast<size_t>(key.x) * 73856093u) ^
+               (static_cast<size_t>(key.y) * 19349663u) ^
+               (static_cast<size_t>(key.z) * 83492791u);
+    }
+};
+
 /////////////////////////////////////////////////////////////////////////////////
 
 // Constructor
@@ -69,6 +81,9 @@ bool Loader::loadOBJFile(const std::string& filename)
         return false;
     }
 
+    // Face corners with the same indices share one mesh vertex
+    std::map<std::string, std::unordered_map<Vector3i, int, VertexKeyHash>> meshVertices;
+
     std::string line;
     std::string meshName;
     std::string materialName;
@@ -127,16 +142,14 @@ bool Loader::loadOBJFile(const std::string& filename)
         {
             iss >> chTrash >> meshName;
             m_MeshTriangles[meshName] = std::make_shared<MeshTriangle>(meshName);
+            meshVertices[meshName].clear();
         }
         else if (line.compare(0, 7, "usemtl ") == 0)  // usemtl
         {
             iss >> strTrash >> materialName;  // update current material name
 
-            // At this time, materials are initialized in m_Materials,
-            // but they are not set up in Triangles. We can't do it because
-            // Triangles are not created in a MeshTriangle.
-            // Solution: configure when creating a triangle
-            // Improvement: move material info to MeshTriangle
+            // Materials are looked up when a triangle is added, which gives the
+            // mesh's material ID
         }
         // Faces
         else if (line.compare(0, 2, "f ") == 0)  // f
@@ -152,6 +165,17 @@ bool Loader::loadOBJFile(const std::string& filename)
             }
 
             std::shared_ptr<MeshTriangle> meshTriangle = m_MeshTriangles[meshName];
+            auto&                         vertexIds = meshVertices[meshName];
+            auto addVertex = [&](const Vector3i& corner) {
+                auto iter = vertexIds.find(corner);
+                if (iter != vertexIds.end()) return iter->second;
+
+                int id = meshTriangle->AddVertex(m_Verts[corner.x], m_Normals[corner.z],
+                                                 m_TexCoords[corner.y]);
+                vertexIds.emplace(corner, id);
+                return id;
+            };
+
             for (int i = 1; i < vertIndices.size() - 1; ++i)
             {
                 // Make a triangle
@@ -167,21 +191,10 @@ bool Loader::loadOBJFile(const std::string& filename)
                     continue;
                 }
 
-                std::shared_ptr<Triangle> triangle =
-                    std::make_shared<Triangle>(v0, v1, v2);
-                triangle->material = m_Materials[materialName];
-
-                // TexCoords
-                triangle->t0 = m_TexCoords[vertIndices[0].y];
-                triangle->t1 = m_TexCoords[vertIndices[i].y];
-                triangle->t2 = m_TexCoords[vertIndices[i + 1].y];
-
-                // Normals
-                triangle->n0 = m_Normals[vertIndices[0].z];
-                triangle->n1 = m_Normals[vertIndices[i].z];
-                triangle->n2 = m_Normals[vertIndices[i + 1].z];
-
-                meshTriangle->AddTriangle(triangle);
+                int i0 = addVertex(vertIndices[0]);
+                int i1 = addVertex(vertIndices[i]);
+                int i2 = addVertex(vertIndices[i + 1]);
+                meshTriangle->AddTriangle(i0, i1, i2, m_Materials[materialName]);
             }
         }
     }
@@ -274,19 +287,7 @@ void Loader::normalizePositionVertices()
 
     for (auto iter = m_MeshTriangles.begin(); iter != m_MeshTriangles.end(); ++iter)
     {
-        std::shared_ptr<MeshTriangle> meshTriangle = iter->second;
-
-        for (size_t i = 0; i < meshTriangle->NumTriangles(); ++i)
-        {
-            std::shared_ptr<Triangle> triangle = meshTriangle->GetTriangle(i);
-
-            triangle->v0 = triangle->v0 * scale + translate;
-            triangle->v1 = triangle->v1 * scale + translate;
-            triangle->v2 = triangle->v2 * scale + translate;
-
-            triangle->e1 = triangle->v1 - triangle->v0;
-            triangle->e2 = triangle->v2 - triangle->v0;
-        }
+        iter->second->ApplyTransform(translate, Vector3f(0.f), scale);
     }
 }
 
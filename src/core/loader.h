@@ -14,7 +14,6 @@
 #include "common.h"
 
 class MeshTriangle;
-class Triangle;
 class Material;
 class Texture;
 
@@ -0,0 +1,52 @@
+//
+// Created by Junhao Wang (@Forkercat) on 2021/5/28.
+//
+
+#ifndef SRC_CORE_NODELAYOUT_H_
+#define SRC_CORE_NODELAYOUT_H_
+
+#include <vector>
+
+// Clusters are sized to a 4 KB page
+const int NodeClusterBytes = 4096;
+
+// Cache-Friendly Node Layout (subtree clustering)
+// The tree is cut into clusters of up to clusterSize items, each grown breadth-first
+// from its root. A cluster thus holds the complete top levels of a subtree, with
+// siblings next to each other. Clusters are emitted depth-first, so that every
+// cluster lies close to the one above it. An item is a node or any unit that has to
+// stay contiguous, like a sibling pair of the binary BVH.
+//
+// children(item, out) appends the child items of item to out. Returns the items in
+// layout order, with the root (item 0) first and parents before their children.
+template <typename ChildrenFunc>
+std::vector<int> ClusteredLayout(int numItems, int clusterSize,
+                                 const ChildrenFunc& children)
+{
+    std::vector<int> order;
+    order.reserve(numItems);
+    if (numItems == 0) return order;
+
+    std::vector<int> roots(1, 0);
+    std::vector<int> queue;
+    while (!roots.empty())
+    {
+        queue.assign(1, roots.back());
+        roots.pop_back();
+
+        size_t head = 0;
+        for (int placed = 0; head < queue.size() && placed < clusterSize; ++placed)
+        {
+            int item = queue[head++];
+            order.push_back(item);
+            children(item, queue);
+        }
+
+        // Whatever did not fit roots the next clusters, the first one on top
+        roots.insert(roots.end(), queue.rbegin(), queue.rend() - head);
+    }
+
+    return order;
+}
+
+#endif  // SRC_CORE_NODELAYOUT_H_
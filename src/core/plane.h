@@ -45,7 +45,40 @@ public:
         m_Triangles[1]->material = mat;
     }
 
-    bool Hit(const Ray& ray, Float tMin, Float tMax, HitRecord& hitRecord) const override;
+    // hit.primitive is the triangle that was hit
+    bool Intersect(const Ray& ray, Float tMin, Float tMax, RayHit& hit) const override;
+    void ComputeHitRecord(const Ray& ray, const RayHit& hit,
+                          HitRecord& hitRecord) const override
+    {
+        m_Triangles[hit.primitive]->ComputeHitRecord(ray, hit, hitRecord);
+    }
+    bool Occluded(const Ray& ray, Float tMin, Float tMax) const override;
+
+    // Like Intersect(), the second triangle is only tested for rays that missed the
+    // first
+    uint32_t IntersectPacket(const RayPacket& packet, uint32_t activeMask, Float tMin,
+                             Float tMax[], RayHit hits[]) const override
+    {
+        uint32_t hitMask = m_Triangles[0]->IntersectPacket(packet, activeMask, tMin, tMax,
+                                                           hits);
+        uint32_t hitMask1 = m_Triangles[1]->IntersectPacket(packet, activeMask & ~hitMask,
+                                                            tMin, tMax, hits);
+        for (int i = 0; i < packet.size; ++i)
+        {
+            if (hitMask & (1u << i)) hits[i].primitive = 0;
+            if (hitMask1 & (1u << i)) hits[i].primitive = 1;
+        }
+        return hitMask | hitMask1;
+    }
+
+    uint32_t OccludedPacket(const RayPacket& packet, uint32_t activeMask, Float tMin,
+                            const Float tMax[]) const override
+    {
+        uint32_t occludedMask =
+            m_Triangles[0]->OccludedPacket(packet, activeMask, tMin, tMax);
+        return occludedMask | m_Triangles[1]->OccludedPacket(
+                                  packet, activeMask & ~occludedMask, tMin, tMax);
+    }
 
     void ApplyTransform(const Vector3f &translate, const Vector3f& rotate, Float scale) override
     {
@@ -65,15 +98,17 @@ private:
     std::shared_ptr<Triangle> m_Triangles[2];
 };
 
-bool Plane::Hit(const Ray& ray, Float tMin, Float tMax, HitRecord& hitRecord) const
+inline bool Plane::Intersect(const Ray& ray, Float tMin, Float tMax, RayHit& hit) const
 {
-    if (m_Triangles[0]->Hit(ray, tMin, tMax, hitRecord))
+    if (m_Triangles[0]->Intersect(ray, tMin, tMax, hit))
     {
+        hit.primitive = 0;
         return true;
     }
 
-    if (m_Triangles[1]->Hit(ray, tMin, tMax, hitRecord))
+    if (m_Triangles[1]->Intersect(ray, tMin, tMax, hit))
     {
+        hit.primitive = 1;
         return true;
     }
 
@@ -89,4 +124,10 @@ bool Plane::Hit(const Ray& ray, Float tMin, Float tMax, HitRecord& hitRecord) co
     // ymin)); return true;
 }
 
+inline bool Plane::Occluded(const Ray& ray, Float tMin, Float tMax) const
+{
+    return m_Triangles[0]->Occluded(ray, tMin, tMax) ||
+           m_Triangles[1]->Occluded(ray, tMin, tMax);
+}
+
 #endif  // CORE_RECTANGLE_H_
@@ -0,0 +1,201 @@
+//
+// Created by Junhao Wang (@Forkercat) on 2021/5/29.
+//
+
+#ifndef SRC_CORE_PRIMITIVESET_H_
+#define SRC_CORE_PRIMITIVESET_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "hittable.h"
+
+// Primitive Set
+// Primitives that a BVH refers to by index instead of holding them as objects, like
+// the triangles of a mesh. A leaf hands its whole range of indices to the set in one
+// call, so the set may keep its primitives in any layout and test them together.
+class PrimitiveSet
+{
+public:
+    virtual ~PrimitiveSet() = default;
+
+    virtual int     NumPrimitives() const = 0;
+    virtual Bounds3 PrimitiveBound(int index) const = 0;
+    // See Hittable::SplitBound()
+    virtual void    SplitPrimitiveBound(int index, const Bounds3& bounds, int axis,
+                                        Float position, Bounds3& left,
+                                        Bounds3& right) const = 0;
+
+    // Closest hit in (tMin, tMax) among the primitives indices[0, count), see
+    // Hittable::Intersect()
+    virtual bool IntersectPrimitives(const int32_t* indices, int count, const Ray& ray,
+                                     Float tMin, Float tMax, RayHit& hit) const = 0;
+    virtual bool OccludedPrimitives(const int32_t* indices, int count, const Ray& ray,
+                                    Float tMin, Float tMax) const = 0;
+    // Hit record of a hit that IntersectPrimitives() found
+    virtual void ComputePrimitiveHitRecord(const Ray& ray, const RayHit& hit,
+                                           HitRecord& hitRecord) const = 0;
+
+    // Same as Hittable::IntersectPacket() and OccludedPacket(), over the primitives
+    // indices[0, count)
+    virtual uint32_t IntersectPrimitivesPacket(const int32_t* indices, int count,
+                                               const RayPacket& packet,
+                                               uint32_t activeMask, Float tMin,
+                                               Float tMax[], RayHit hits[]) const = 0;
+    virtual uint32_t OccludedPrimitivesPacket(const int32_t* indices, int count,
+                                              const RayPacket& packet,
+                                              uint32_t activeMask, Float tMin,
+                                              const Float tMax[]) const = 0;
+
+    // Packed Leaves
+    // A set may copy its primitives into the leaf order of a BVH, laid out so that a
+    // leaf is tested in one pass (e.g. triangles in SoA for a SIMD kernel). The BVH
+    // keeps the copy and passes it back with the position of the leaf in its index
+    // array. A set that leaves packed empty is only called through
+    // IntersectPrimitives() and OccludedPrimitives().
+    virtual void PackLeaves(const std::vector<int32_t>& /*indices*/,
+                            std::vector<Float>&         packed) const
+    {
+        packed.clear();
+    }
+
+    // Same as IntersectPrimitives() and OccludedPrimitives() over the leaf
+    // indices[first, first + count) of the BVH that packed
+    virtual bool IntersectPackedLeaf(const std::vector<Float>&   /*packed*/,
+                                     const std::vector<int32_t>& indices, int first,
+                                     int count, const Ray& ray, Float tMin, Float tMax,
+                                     RayHit& hit) const
+    {
+        return IntersectPrimitives(&indices[first], count, ray, tMin, tMax, hit);
+    }
+    virtual bool OccludedPackedLeaf(const std::vector<Float>&   /*packed*/,
+                                    const std::vector<int32_t>& indices, int first,
+                                    int count, const Ray& ray, Float tMin,
+                                    Float tMax) const
+    {
+        return OccludedPrimitives(&indices[first], count, ray, tMin, tMax);
+    }
+
+    // A BVH leaf, with the packed copy if the set made one
+    bool IntersectLeaf(const std::vector<Float>&   packed,
+                       const std::vector<int32_t>& indices, int first, int count,
+                       const Ray& ray, Float tMin, Float tMax, RayHit& hit) const
+    {
+        if (packed.empty())
+            return IntersectPrimitives(&indices[first], count, ray, tMin, tMax, hit);
+        return IntersectPackedLeaf(packed, indices, first, count, ray, tMin, tMax, hit);
+    }
+
+    bool OccludedLeaf(const std::vector<Float>&   packed,
+                      const std::vector<int32_t>& indices, int first, int count,
+                      const Ray& ray, Float tMin, Float tMax) const
+    {
+        if (packed.empty())
+            return OccludedPrimitives(&indices[first], count, ray, tMin, tMax);
+        return OccludedPackedLeaf(packed, indices, first, count, ray, tMin, tMax);
+    }
+};
+
+// Hittable objects as a PrimitiveSet, e.g. the objects of a scene. The slot of the
+// set's level in RayHit::objects is the index of the object that was hit.
+class HittablePrimitives : public PrimitiveSet
+{
+public:
+    // Constructor
+    explicit HittablePrimitives(const std::vector<std::shared_ptr<Hittable>>& objects)
+        : m_Objects(objects)
+    {
+    }
+
+    int     NumPrimitives() const override { return static_cast<int>(m_Objects.size()); }
+    Bounds3 PrimitiveBound(int index) const override
+    {
+        return m_Objects[index]->WorldBound();
+    }
+
+    void SplitPrimitiveBound(int index, const Bounds3& bounds, int axis, Float position,
+                             Bounds3& left, Bounds3& right) const override
+    {
+        m_Objects[index]->SplitBound(bounds, axis, position, left, right);
+    }
+
+    bool IntersectPrimitives(const int32_t* indices, int count, const Ray& ray,
+                             Float tMin, Float tMax, RayHit& hit) const override
+    {
+        bool hitAnything = false;
+        int  level = hit.EnterObjectSet();
+        for (int i = 0; i < count; ++i)
+        {
+            if (m_Objects[indices[i]]->Intersect(ray, tMin, tMax, hit))
+            {
+                hitAnything = true;
+                tMax = hit.t;
+                hit.objects[level] = indices[i];
+            }
+        }
+        hit.LeaveObjectSet();
+        return hitAnything;
+    }
+
+    bool OccludedPrimitives(const int32_t* indices, int count, const Ray& ray, Float tMin,
+                            Float tMax) const override
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            if (m_Objects[indices[i]]->Occluded(ray, tMin, tMax)) return true;
+        }
+        return false;
+    }
+
+    void ComputePrimitiveHitRecord(const Ray& ray, const RayHit& hit,
+                                   HitRecord& hitRecord) const override
+    {
+        RayHit objectHit = hit;
+        int    level = objectHit.EnterObjectSet();
+        m_Objects[hit.objects[level]]->ComputeHitRecord(ray, objectHit, hitRecord);
+    }
+
+    uint32_t IntersectPrimitivesPacket(const int32_t* indices, int count,
+                                       const RayPacket& packet, uint32_t activeMask,
+                                       Float tMin, Float tMax[],
+                                       RayHit hits[]) const override
+    {
+        uint32_t hitMask = 0;
+        int      level = 0;
+        for (int j = 0; j < packet.size; ++j) level = hits[j].EnterObjectSet();
+        for (int i = 0; i < count; ++i)
+        {
+            uint32_t mask = m_Objects[indices[i]]->IntersectPacket(packet, activeMask, tMin,
+                                                                   tMax, hits);
+            for (int j = 0; j < packet.size; ++j)
+            {
+                if (mask & (1u << j)) hits[j].objects[level] = indices[i];
+            }
+            hitMask |= mask;
+        }
+        for (int j = 0; j < packet.size; ++j) hits[j].LeaveObjectSet();
+        return hitMask;
+    }
+
+    uint32_t OccludedPrimitivesPacket(const int32_t* indices, int count,
+                                      const RayPacket& packet, uint32_t activeMask,
+                                      Float tMin, const Float tMax[]) const override
+    {
+        uint32_t occludedMask = 0;
+        for (int i = 0; i < count && activeMask; ++i)
+        {
+            uint32_t occluded =
+                m_Objects[indices[i]]->OccludedPacket(packet, activeMask, tMin, tMax);
+            occludedMask |= occluded;
+            activeMask &= ~occluded;
+        }
+        return occludedMask;
+    }
+
+private:
+    // Private Data
+    std::vector<std::shared_ptr<Hittable>> m_Objects;
+};
+
+#endif  // SRC_CORE_PRIMITIVESET_H_
@@ -0,0 +1,45 @@
+//
+// Created by Junhao Wang (@Forkercat) on 2021/5/29.
+//
+
+#ifndef SRC_CORE_RAYPACKET_H_
+#define SRC_CORE_RAYPACKET_H_
+
+#include <cstdint>
+
+#include "ray.h"
+
+// Ray Packet
+// Up to MaxSize coherent rays (e.g. the camera rays of neighboring pixels) that are
+// traced together. The rays are kept both as they are, for scalar fallbacks, and in
+// SoA layout, so that SIMD kernels test several rays against one box or triangle.
+// Packet queries take a mask of active rays: bit i refers to ray i.
+struct RayPacket
+{
+    static const int MaxSize = 16;
+
+    RayPacket() : size(0), rays(), origin(), dir(), invDir() { }
+
+    void Add(const Ray& ray)
+    {
+        rays[size] = ray;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            origin[axis][size] = ray.origin[axis];
+            dir[axis][size] = ray.dir[axis];
+            invDir[axis][size] = ray.invDir[axis];
+        }
+        ++size;
+    }
+
+    uint32_t FullMask() const { return (1u << size) - 1u; }
+
+    // Public Data
+    int   size;
+    Ray   rays[MaxSize];
+    Float origin[3][MaxSize];  // [axis][ray], entries past size are zero
+    Float dir[3][MaxSize];
+    Float invDir[3][MaxSize];
+};
+
+#endif  // SRC_CORE_RAYPACKET_H_
@@ -8,37 +8,109 @@
 
 #include "bvh.h"
 
-void Scene::BuildBVH()
+void Scene::BuildBVH(const BVHBuildOptions& options)
 {
     spdlog::info("[Scene] Building BVH...");
-    m_Bvh = std::make_shared<BVHAccel>(*this);
+    m_Bvh = std::make_shared<BVHAccel>(*this, options);
 }
 
-bool Scene::Hit(const Ray& ray, Float tMin, Float tMax, HitRecord& hitRecord) const
+void Scene::RefitBVH()
 {
     if (m_Bvh)
     {
-        return m_Bvh->Hit(ray, tMin, tMax, hitRecord);
+        m_Bvh->Refit();
     }
-    else
+}
+
+bool Scene::Intersect(const Ray& ray, Float tMin, Float tMax, RayHit& hit) const
+{
+    if (m_Bvh)
+    {
+        return m_Bvh->Intersect(ray, tMin, tMax, hit);
+    }
+
+    bool hitAnything = false;
+    int  level = hit.EnterObjectSet();
+    for (int i = 0; i < static_cast<int>(m_Objects.size()); ++i)
+    {
+        if (m_Objects[i]->Intersect(ray, tMin, tMax, hit))
+        {
+            hitAnything = true;
+            tMax = hit.t;
+            hit.objects[level] = i;
+        }
+    }
+    hit.LeaveObjectSet();
+    return hitAnything;
+}
+
+void Scene::ComputeHitRecord(const Ray& ray, const RayHit& hit, HitRecord& hitRecord) const
+{
+    if (m_Bvh)
+    {
+        m_Bvh->ComputeHitRecord(ray, hit, hitRecord);
+        return;
+    }
+
+    RayHit objectHit = hit;
+    int    level = objectHit.EnterObjectSet();
+    m_Objects[hit.objects[level]]->ComputeHitRecord(ray, objectHit, hitRecord);
+}
+
+bool Scene::Occluded(const Ray& ray, Float tMin, Float tMax) const
+{
+    if (m_Bvh)
     {
-        HitRecord tempRecord;
-        bool      hitAnything = false;
+        return m_Bvh->Occluded(ray, tMin, tMax);
+    }
 
-        Float closestSoFar = tMax;
+    for (const auto& object : m_Objects)
+    {
+        if (object->Occluded(ray, tMin, tMax)) return true;
+    }
+    return false;
+}
+
+uint32_t Scene::IntersectPacket(const RayPacket& packet, uint32_t activeMask, Float tMin,
+                                Float tMax[], RayHit hits[]) const
+{
+    if (m_Bvh)
+    {
+        return m_Bvh->IntersectPacket(packet, activeMask, tMin, tMax, hits);
+    }
 
-        for (const auto& object : m_Objects)
+    uint32_t hitMask = 0;
+    int      level = 0;
+    for (int j = 0; j < packet.size; ++j) level = hits[j].EnterObjectSet();
+    for (int i = 0; i < static_cast<int>(m_Objects.size()); ++i)
+    {
+        uint32_t mask = m_Objects[i]->IntersectPacket(packet, activeMask, tMin, tMax, hits);
+        for (int j = 0; j < packet.size; ++j)
         {
-            if (object->Hit(ray, tMin, closestSoFar, tempRecord))
-            {
-                hitAnything = true;
-                closestSoFar = tempRecord.t;
-                hitRecord = tempRecord;
-            }
+            if (mask & (1u << j)) hits[j].objects[level] = i;
         }
+        hitMask |= mask;
+    }
+    for (int j = 0; j < packet.size; ++j) hits[j].LeaveObjectSet();
+    return hitMask;
+}
+
+uint32_t Scene::OccludedPacket(const RayPacket& packet, uint32_t activeMask, Float tMin,
+                               const Float tMax[]) const
+{
+    if (m_Bvh)
+    {
+        return m_Bvh->OccludedPacket(packet, activeMask, tMin, tMax);
+    }
 
-        return hitAnything;
+    uint32_t occludedMask = 0;
+    for (const auto& object : m_Objects)
+    {
+        occludedMask |=
+            object->OccludedPacket(packet, activeMask & ~occludedMask, tMin, tMax);
+        if (occludedMask == activeMask) break;
     }
+    return occludedMask;
 }
 
 Bounds3 Scene::WorldBound() const  // expensive
@@ -8,11 +8,10 @@
 #include <vector>
 
 #include "bounds.h"
+#include "bvh.h"
 #include "common.h"
 #include "hittable.h"
 
-class BVHAccel;
-
 class Scene : public Hittable
 {
 public:
@@ -24,9 +23,18 @@ public:
 
     const std::vector<std::shared_ptr<Hittable>>& GetObjects() const { return m_Objects; }
 
-    void BuildBVH();
-
-    bool Hit(const Ray& ray, Float tMin, Float tMax, HitRecord& hitRecord) const override;
+    void BuildBVH(const BVHBuildOptions& options = BVHBuildOptions());
+    void RefitBVH();  // after objects have been transformed
+
+    // The slot of the scene's level in hit.objects is the index of the object hit
+    bool Intersect(const Ray& ray, Float tMin, Float tMax, RayHit& hit) const override;
+    void ComputeHitRecord(const Ray& ray, const RayHit& hit,
+                          HitRecord& hitRecord) const override;
+    bool Occluded(const Ray& ray, Float tMin, Float tMax) const override;
+    uint32_t IntersectPacket(const RayPacket& packet, uint32_t activeMask, Float tMin,
+                             Float tMax[], RayHit hits[]) const override;
+    uint32_t OccludedPacket(const RayPacket& packet, uint32_t activeMask, Float tMin,
+                            const Float tMax[]) const override;
     Bounds3 WorldBound() const override;
 
     inline bool SupportBVH() const { return m_Bvh != nullptr; }
@@ -0,0 +1,51 @@
+//
+// Created by Junhao Wang (@Forkercat) on 2021/5/20.
+//
+
+#include "scheduler.h"
+
+#include "threadpool.h"
+
+// Constructor
+TileScheduler::TileScheduler(int imageWidth, int imageHeight, int tileSize)
+    : m_Tiles(), m_NumTilesDone(0)
+{
+    CHECK_GT(tileSize, 0);
+
+    // Top rows first, matching the scanline order of the output image
+    for (int y1 = imageHeight; y1 > 0; y1 -= tileSize)
+    {
+        for (int x0 = 0; x0 < imageWidth; x0 += tileSize)
+        {
+            Tile tile;
+            tile.x0 = x0;
+            tile.x1 = Min(x0 + tileSize, imageWidth);
+            tile.y0 = Max(y1 - tileSize, 0);
+            tile.y1 = y1;
+            m_Tiles.push_back(tile);
+        }
+    }
+}
+
+void TileScheduler::Render(ThreadPool& pool, const RenderTileFunc& renderTile,
+                           const ProgressFunc& progress)
+{
+    m_NumTilesDone = 0;
+
+    // The calling thread renders tiles as well while it waits
+    TaskGroup group(pool);
+    for (const Tile& tile : m_Tiles)
+    {
+        group.Run([this, &tile, &renderTile, &progress]() {
+            renderTile(tile);
+
+            ++m_NumTilesDone;
+            if (progress)
+            {
+                std::lock_guard<std::mutex> lock(m_ProgressMutex);
+                progress((Float)m_NumTilesDone / NumTiles());
+            }
+        });
+    }
+    group.Wait();
+}
@@ -0,0 +1,49 @@
+//
+// Created by Junhao Wang (@Forkercat) on 2021/5/20.
+//
+
+#ifndef SRC_CORE_SCHEDULER_H_
+#define SRC_CORE_SCHEDULER_H_
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "common.h"
+
+class ThreadPool;
+
+// Tile: pixels in [x0, x1) x [y0, y1)
+struct Tile
+{
+    int x0, y0;
+    int x1, y1;
+};
+
+// TileScheduler splits the image into tiles and renders them as tasks on a thread
+// pool. Workers own deques of tiles and steal from each other once their own
+// deque runs dry, so no worker idles while there is still work left.
+class TileScheduler
+{
+public:
+    using RenderTileFunc = std::function<void(const Tile&)>;
+    using ProgressFunc = std::function<void(Float)>;
+
+    // Constructor
+    TileScheduler(int imageWidth, int imageHeight, int tileSize);
+
+    int NumTiles() const { return static_cast<int>(m_Tiles.size()); }
+
+    // Blocks until every tile has been rendered
+    void Render(ThreadPool& pool, const RenderTileFunc& renderTile,
+                const ProgressFunc& progress = nullptr);
+
+private:
+    // Private Data
+    std::vector<Tile> m_Tiles;
+    std::atomic<int>  m_NumTilesDone;
+    std::mutex        m_ProgressMutex;
+};
+
+#endif  // SRC_CORE_SCHEDULER_H_
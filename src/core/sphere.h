@@ -16,7 +16,10 @@ public:
     Sphere(const Point3f& cen, Float rad, const std::shared_ptr<Material>& mat)
         : center(cen), radius(rad), material(mat){};
 
-    bool Hit(const Ray& ray, Float tMin, Float tMax, HitRecord& hitRecord) const override;
+    bool Intersect(const Ray& ray, Float tMin, Float tMax, RayHit& hit) const override;
+    void ComputeHitRecord(const Ray& ray, const RayHit& hit,
+                          HitRecord& hitRecord) const override;
+    bool Occluded(const Ray& ray, Float tMin, Float tMax) const override;
 
     void ApplyTransform(const Vector3f &translate, const Vector3f& rotate, Float scale) override;
 
@@ -29,15 +32,44 @@ public:
     Point3f              center;
     Float                radius;
     std::shared_ptr<Material> material;
+
+private:
+    bool intersect(const Ray& ray, Float tMin, Float tMax, Float& root) const;
 };
 
-void Sphere::ApplyTransform(const Vector3f& translate, const Vector3f& rotate, Float scale)
+inline void Sphere::ApplyTransform(const Vector3f& translate, const Vector3f& rotate, Float scale)
 {
     center += translate;
     radius *= scale;
 }
 
-bool Sphere::Hit(const Ray& ray, Float tMin, Float tMax, HitRecord& hitRecord) const
+inline bool Sphere::Intersect(const Ray& ray, Float tMin, Float tMax, RayHit& hit) const
+{
+    Float root;
+    if (!intersect(ray, tMin, tMax, root)) return false;
+
+    hit.t = root;
+    return true;
+}
+
+inline void Sphere::ComputeHitRecord(const Ray& ray, const RayHit& hit,
+                                     HitRecord& hitRecord) const
+{
+    hitRecord.t = hit.t;
+    hitRecord.p = ray(hitRecord.t);
+    Vector3f outwardNormal = (hitRecord.p - center) / radius;
+    hitRecord.SetFrontFace(ray, outwardNormal);
+    hitRecord.material = material.get();
+}
+
+inline bool Sphere::Occluded(const Ray& ray, Float tMin, Float tMax) const
+{
+    Float root;
+    return intersect(ray, tMin, tMax, root);
+}
+
+// Closest root in [tMin, tMax]
+inline bool Sphere::intersect(const Ray& ray, Float tMin, Float tMax, Float& root) const
 {
     Vector3f oc = ray.origin - center;  // A - C
     Float    a = Dot(ray.dir, ray.dir);
@@ -49,7 +81,7 @@ bool Sphere::Hit(const Ray& ray, Float tMin, Float tMax, HitRecord& hitRecord) c
     if (discriminant < 0) return false;
 
     Float sqrtDiscriminant = std::sqrt(discriminant);
-    Float root = (-bOver2 - sqrtDiscriminant) / a;  // smaller root
+    root = (-bOver2 - sqrtDiscriminant) / a;  // smaller root
 
     if (root < tMin || root > tMax)
     {
@@ -57,13 +89,6 @@ bool Sphere::Hit(const Ray& ray, Float tMin, Float tMax, HitRecord& hitRecord) c
         if (root < tMin || root > tMax) return false;
     }
 
-    // Hit
-    hitRecord.t = root;
-    hitRecord.p = ray(hitRecord.t);
-    Vector3f outwardNormal = (hitRecord.p - center) / radius;
-    hitRecord.SetFrontFace(ray, outwardNormal);
-    hitRecord.material = material;
-
     return true;
 }
 
@@ -0,0 +1,232 @@
+//
+// Created by Junhao Wang (@Forkercat) on 2021/5/22.
+//
+
+#include "threadpool.h"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace
+{
+// Pool and queue that the current thread works for (nullptr / -1 if it is not a worker)
+thread_local ThreadPool* t_Pool = nullptr;
+thread_local int         t_QueueId = -1;
+
+std::mutex                  s_GlobalMutex;
+std::unique_ptr<ThreadPool> s_GlobalPool;
+}  // namespace
+
+// Constructor
+ThreadPool::ThreadPool(int numThreads)
+    : m_Workers(), m_Queues(), m_NumPending(0), m_NextQueue(0), m_Shutdown(false)
+{
+    int numWorkers = std::max(numThreads, 1) - 1;
+
+    // The last queue is shared by threads outside the pool
+    for (int i = 0; i <= numWorkers; ++i)
+    {
+        m_Queues.push_back(std::make_unique<WorkerQueue>());
+    }
+
+    for (int i = 0; i < numWorkers; ++i)
+    {
+        m_Workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_SleepMutex);
+        m_Shutdown = true;
+    }
+    m_SleepCondition.notify_all();
+
+    for (auto& worker : m_Workers)
+    {
+        worker.join();
+    }
+}
+
+void ThreadPool::Submit(Task task)
+{
+    // Workers keep their own tasks local; others spread them over all queues
+    int queueId = (t_Pool == this)
+                      ? t_QueueId
+                      : static_cast<int>(m_NextQueue++ % m_Queues.size());
+
+    {
+        WorkerQueue&                queue = *m_Queues[queueId];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+    ++m_NumPending;
+
+    {
+        std::lock_guard<std::mutex> lock(m_SleepMutex);
+    }
+    m_SleepCondition.notify_one();
+}
+
+bool ThreadPool::RunPendingTask()
+{
+    int  queueId = (t_Pool == this) ? t_QueueId : static_cast<int>(m_Workers.size());
+    Task task;
+
+    if (popTask(queueId, task) || stealTask(queueId, task))
+    {
+        task();
+        return true;
+    }
+    return false;
+}
+
+// Global Pool
+
+int ThreadPool::DefaultNumThreads()
+{
+    if (const char* env = std::getenv("FORKER_NUM_THREADS"))
+    {
+        int numThreads = std::atoi(env);
+        if (numThreads > 0) return numThreads;
+
+        spdlog::warn("Ignoring invalid FORKER_NUM_THREADS: {}", env);
+    }
+
+    return std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+}
+
+void ThreadPool::Init(int numThreads)
+{
+    std::lock_guard<std::mutex> lock(s_GlobalMutex);
+
+    if (s_GlobalPool != nullptr)
+    {
+        spdlog::warn("ThreadPool has already been initialized with {} threads.",
+                     s_GlobalPool->NumThreads());
+        return;
+    }
+
+    s_GlobalPool = std::make_unique<ThreadPool>(numThreads);
+}
+
+ThreadPool& ThreadPool::Global()
+{
+    std::lock_guard<std::mutex> lock(s_GlobalMutex);
+
+    if (s_GlobalPool == nullptr)
+    {
+        s_GlobalPool = std::make_unique<ThreadPool>(DefaultNumThreads());
+    }
+    return *s_GlobalPool;
+}
+
+// Private Methods
+
+void ThreadPool::workerLoop(int workerId)
+{
+    t_Pool = this;
+    t_QueueId = workerId;
+
+    while (true)
+    {
+        Task task;
+        if (popTask(workerId, task) || stealTask(workerId, task))
+        {
+            task();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_SleepMutex);
+        m_SleepCondition.wait(lock, [this] { return m_Shutdown || m_NumPending > 0; });
+
+        if (m_Shutdown) return;
+    }
+}
+
+// Owner takes the most recent task from the back of its own deque
+bool ThreadPool::popTask(int queueId, Task& task)
+{
+    WorkerQueue&                queue = *m_Queues[queueId];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+
+    if (queue.tasks.empty()) return false;
+
+    task = std::move(queue.tasks.back());
+    queue.tasks.pop_back();
+    --m_NumPending;
+    return true;
+}
+
+// Thieves take the oldest task from the front of a victim's deque
+bool ThreadPool::stealTask(int queueId, Task& task)
+{
+    int numQueues = static_cast<int>(m_Queues.size());
+
+    for (int i = 1; i < numQueues; ++i)
+    {
+        WorkerQueue&                queue = *m_Queues[(queueId + i) % numQueues];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+
+        if (queue.tasks.empty()) continue;
+
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+        --m_NumPending;
+        return true;
+    }
+
+    return false;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+// Constructor
+TaskGroup::TaskGroup(ThreadPool& pool) : m_Pool(pool), m_NumRemaining(0)
+{
+}
+
+void TaskGroup::Run(ThreadPool::Task task)
+{
+    ++m_NumRemaining;
+    m_Pool.Submit([this, task = std::move(task)]() {
+        task();
+        --m_NumRemaining;
+    });
+}
+
+void TaskGroup::Wait()
+{
+    while (m_NumRemaining > 0)
+    {
+        if (!m_Pool.RunPendingTask())
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+void ParallelFor(int start, int finish, int grainSize,
+                 const std::function<void(int, int)>& func)
+{
+    grainSize = std::max(grainSize, 1);
+
+    if (finish - start <= grainSize)
+    {
+        if (start < finish) func(start, finish);
+        return;
+    }
+
+    TaskGroup group;
+    for (int begin = start; begin < finish; begin += grainSize)
+    {
+        int end = std::min(begin + grainSize, finish);
+        group.Run([&func, begin, end]() { func(begin, end); });
+    }
+    group.Wait();
+}
@@ -0,0 +1,90 @@
+//
+// Created by Junhao Wang (@Forkercat) on 2021/5/22.
+//
+
+#ifndef SRC_CORE_THREADPOOL_H_
+#define SRC_CORE_THREADPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// ThreadPool keeps a fixed set of workers alive for the whole run. Every worker
+// owns a deque of tasks: it pushes and pops at the back (depth-first for nested
+// work) while idle workers steal from the front of the others.
+//
+// The thread that waits on a TaskGroup helps executing tasks, so a pool of N
+// threads spawns N - 1 workers and N = 1 runs everything inline.
+class ThreadPool
+{
+public:
+    using Task = std::function<void()>;
+
+    // Constructor
+    explicit ThreadPool(int numThreads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int NumThreads() const { return static_cast<int>(m_Workers.size()) + 1; }
+
+    void Submit(Task task);
+
+    // Runs one pending task on the calling thread. Returns false if there was none.
+    bool RunPendingTask();
+
+    // Global Pool
+    static int         DefaultNumThreads();  // $FORKER_NUM_THREADS or hardware threads
+    static void        Init(int numThreads);  // call before the first Global()
+    static ThreadPool& Global();
+
+private:
+    struct WorkerQueue
+    {
+        std::mutex       mutex;
+        std::deque<Task> tasks;
+    };
+
+    void workerLoop(int workerId);
+    bool popTask(int queueId, Task& task);
+    bool stealTask(int queueId, Task& task);
+
+    // Private Data
+    std::vector<std::thread>                  m_Workers;
+    std::vector<std::unique_ptr<WorkerQueue>> m_Queues;  // one per worker + external
+
+    std::atomic<int>        m_NumPending;
+    std::atomic<unsigned>   m_NextQueue;
+    std::mutex              m_SleepMutex;
+    std::condition_variable m_SleepCondition;
+    bool                    m_Shutdown;
+};
+
+// TaskGroup tracks a batch of tasks on a pool. Wait() executes pending tasks
+// until the whole batch is done, so tasks may safely spawn and wait on subtasks.
+class TaskGroup
+{
+public:
+    // Constructor
+    explicit TaskGroup(ThreadPool& pool = ThreadPool::Global());
+    ~TaskGroup() { Wait(); }
+
+    void Run(ThreadPool::Task task);
+    void Wait();
+
+private:
+    ThreadPool&      m_Pool;
+    std::atomic<int> m_NumRemaining;
+};
+
+// Runs func(begin, end) over [start, finish) in chunks of at most grainSize
+void ParallelFor(int start, int finish, int grainSize,
+                 const std::function<void(int, int)>& func);
+
+#endif  // SRC_CORE_THREADPOOL_H_
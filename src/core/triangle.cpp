@@ -6,7 +6,220 @@
 
 #include <spdlog/spdlog.h>
 
+#include <algorithm>
+#include <chrono>
+
 #include "bvh.h"
+#include "simd.h"
+#include "simdvector.h"
+#include "threadpool.h"
+
+namespace
+{
+// Möller–Trumbore: Get barycentric coordinates
+inline bool IntersectMT(const Ray& ray, const Point3f& v0, const Vector3f& e1,
+                        const Vector3f& e2, Float& tNear, Float& u, Float& v)
+{
+    Vector3f s1 = Cross(ray.dir, e2);
+    float    s1_dot_e1 = Dot(s1, e1);
+
+    // Parallel
+    if (std::abs(s1_dot_e1) < 0.001) return false;
+
+    float inv = 1.f / s1_dot_e1;
+
+    // u
+    Vector3f s = ray.origin - v0;
+    u = Dot(s1, s) * inv;
+    if (u < 0 || u > 1) return false;
+
+    // v
+    Vector3f s2 = Cross(s, e1);
+    v = Dot(s2, ray.dir) * inv;
+    if (v < 0 || u + v > 1) return false;
+
+    // t
+    tNear = Dot(s2, e2) * inv;
+    if (tNear < 0) return false;
+
+    return true;
+}
+
+#ifdef FORKER_SIMD_SSE
+// One component of Cross(a, b) for four vectors a and a constant b, a1 * b2 - a2 * b1.
+// Uses the same precision as Cross(), so the packet kernel gives the same bits as
+// IntersectMT().
+inline __m128 CrossComponent4(__m128 a1, __m128 a2, double b2, double b1)
+{
+#ifdef FORKER_SIMD_VECTOR3
+    return _mm_sub_ps(_mm_mul_ps(a1, _mm_set1_ps(static_cast<float>(b2))),
+                      _mm_mul_ps(a2, _mm_set1_ps(static_cast<float>(b1))));
+#else
+    __m128d b1d = _mm_set1_pd(b1);
+    __m128d b2d = _mm_set1_pd(b2);
+    __m128d lo = _mm_sub_pd(_mm_mul_pd(_mm_cvtps_pd(a1), b2d),
+                            _mm_mul_pd(_mm_cvtps_pd(a2), b1d));
+    __m128d hi = _mm_sub_pd(_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(a1, a1)), b2d),
+                            _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(a2, a2)), b1d));
+    return _mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi));
+#endif
+}
+
+inline __m128 Dot4(__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz)
+{
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)),
+                      _mm_mul_ps(az, bz));
+}
+#endif
+
+// Möller–Trumbore for the active rays of a packet, four at a time. Returns the mask of
+// rays that hit within (tMin, tMax[i]), with the same tests as IntersectMT().
+uint32_t IntersectPacketMT(const RayPacket& packet, uint32_t activeMask, Float tMin,
+                           const Float tMax[], const Point3f& v0, const Vector3f& e1,
+                           const Vector3f& e2, Float tNear[], Float u[], Float v[])
+{
+    uint32_t hitMask = 0;
+#ifdef FORKER_SIMD_SSE
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.f);
+    for (int first = 0; first < packet.size; first += 4)
+    {
+        if (!((activeMask >> first) & 0xf)) continue;
+
+        __m128 dx = _mm_loadu_ps(packet.dir[0] + first);
+        __m128 dy = _mm_loadu_ps(packet.dir[1] + first);
+        __m128 dz = _mm_loadu_ps(packet.dir[2] + first);
+
+        // s1 = Cross(dir, e2)
+        __m128 s1x = CrossComponent4(dy, dz, e2.z, e2.y);
+        __m128 s1y = CrossComponent4(dz, dx, e2.x, e2.z);
+        __m128 s1z = CrossComponent4(dx, dy, e2.y, e2.x);
+        __m128 s1DotE1 = Dot4(s1x, s1y, s1z, _mm_set1_ps(e1.x), _mm_set1_ps(e1.y),
+                              _mm_set1_ps(e1.z));
+
+        // Parallel. 0.001f is the smallest float that is not below 0.001.
+        __m128 absDot = _mm_andnot_ps(_mm_set1_ps(-0.f), s1DotE1);
+        __m128 valid = _mm_cmpnlt_ps(absDot, _mm_set1_ps(0.001f));
+        __m128 inv = _mm_div_ps(one, s1DotE1);
+
+        // u
+        __m128 sx = _mm_sub_ps(_mm_loadu_ps(packet.origin[0] + first), _mm_set1_ps(v0.x));
+        __m128 sy = _mm_sub_ps(_mm_loadu_ps(packet.origin[1] + first), _mm_set1_ps(v0.y));
+        __m128 sz = _mm_sub_ps(_mm_loadu_ps(packet.origin[2] + first), _mm_set1_ps(v0.z));
+        __m128 uu = _mm_mul_ps(Dot4(s1x, s1y, s1z, sx, sy, sz), inv);
+        valid = _mm_andnot_ps(_mm_or_ps(_mm_cmplt_ps(uu, zero), _mm_cmpgt_ps(uu, one)),
+                              valid);
+
+        // v, s2 = Cross(s, e1)
+        __m128 s2x = CrossComponent4(sy, sz, e1.z, e1.y);
+        __m128 s2y = CrossComponent4(sz, sx, e1.x, e1.z);
+        __m128 s2z = CrossComponent4(sx, sy, e1.y, e1.x);
+        __m128 vv = _mm_mul_ps(Dot4(s2x, s2y, s2z, dx, dy, dz), inv);
+        valid = _mm_andnot_ps(
+            _mm_or_ps(_mm_cmplt_ps(vv, zero), _mm_cmpgt_ps(_mm_add_ps(uu, vv), one)),
+            valid);
+
+        // t
+        __m128 t = _mm_mul_ps(Dot4(s2x, s2y, s2z, _mm_set1_ps(e2.x), _mm_set1_ps(e2.y),
+                                   _mm_set1_ps(e2.z)),
+                              inv);
+        valid = _mm_andnot_ps(_mm_cmplt_ps(t, zero), valid);
+        valid = _mm_and_ps(valid, _mm_cmpgt_ps(t, _mm_set1_ps(tMin)));
+        valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_loadu_ps(tMax + first)));
+
+        _mm_storeu_ps(tNear + first, t);
+        _mm_storeu_ps(u + first, uu);
+        _mm_storeu_ps(v + first, vv);
+        hitMask |= static_cast<uint32_t>(_mm_movemask_ps(valid)) << first;
+    }
+    hitMask &= activeMask;
+#else
+    for (int i = 0; i < packet.size; ++i)
+    {
+        if (!(activeMask & (1u << i))) continue;
+
+        if (IntersectMT(packet.rays[i], v0, e1, e2, tNear[i], u[i], v[i]) &&
+            tNear[i] > tMin && tNear[i] < tMax[i])
+        {
+            hitMask |= 1u << i;
+        }
+    }
+#endif
+    return hitMask;
+}
+
+#ifdef FORKER_SIMD_SSE
+// Möller–Trumbore for one ray and N triangles in SoA layout, in one pass. Returns the
+// mask of triangles hit within (tMin, tMax), with the same tests as IntersectMT().
+template <int N>
+uint32_t IntersectMTN(const Ray& ray, const Vec3xN<N>& v0, const Vec3xN<N>& e1,
+                      const Vec3xN<N>& e2, Float tMin, Float tMax, FloatN<N>& tNear,
+                      FloatN<N>& u, FloatN<N>& v)
+{
+    const FloatN<N> zero(0.f);
+    const FloatN<N> one(1.f);
+    Vec3xN<N>       dir(ray.dir);
+
+    Vec3xN<N> s1 = Cross(dir, e2);
+    FloatN<N> s1DotE1 = Dot(s1, e1);
+
+    // Parallel. 0.001f is the smallest float that is not below 0.001.
+    uint32_t  valid = ~LessMask(Abs(s1DotE1), FloatN<N>(0.001f));
+    FloatN<N> inv = one / s1DotE1;
+
+    // u
+    Vec3xN<N> s = Vec3xN<N>(ray.origin) - v0;
+    u = Dot(s1, s) * inv;
+    valid &= ~(LessMask(u, zero) | GreaterMask(u, one));
+
+    // v
+    Vec3xN<N> s2 = Cross(s, e1);
+    v = Dot(s2, dir) * inv;
+    valid &= ~(LessMask(v, zero) | GreaterMask(u + v, one));
+
+    // t
+    tNear = Dot(s2, e2) * inv;
+    valid &= ~LessMask(tNear, zero);
+    valid &= GreaterMask(tNear, FloatN<N>(tMin)) & LessMask(tNear, FloatN<N>(tMax));
+
+    return valid & ((1u << N) - 1);
+}
+#endif
+
+// Clips the triangle's edges against the plane, so the halves bound only the parts of
+// the triangle on either side instead of the whole box
+void SplitTriangleBound(const Point3f vertices[3], const Bounds3& bounds, int axis,
+                        Float position, Bounds3& left, Bounds3& right)
+{
+    left = right = Bounds3();
+
+    for (int i = 0; i < 3; ++i)
+    {
+        const Point3f& p0 = vertices[i];
+        const Point3f& p1 = vertices[(i + 1) % 3];
+        Float          d0 = p0[axis];
+        Float          d1 = p1[axis];
+
+        if (d0 <= position) left = Union(left, p0);
+        if (d0 >= position) right = Union(right, p0);
+
+        // Edge crosses the plane
+        if ((d0 < position && position < d1) || (d1 < position && position < d0))
+        {
+            Float   t = (position - d0) / (d1 - d0);
+            Point3f p = p0 + t * (p1 - p0);
+            p[axis] = position;
+            left = Union(left, p);
+            right = Union(right, p);
+        }
+    }
+
+    left = Intersect(left, bounds);
+    right = Intersect(right, bounds);
+    if (left.IsEmpty()) left = Bounds3();
+    if (right.IsEmpty()) right = Bounds3();
+}
+}  // namespace
 
 // Constructor
 Triangle::Triangle(const Point3f& v0, const Point3f& v1, const Point3f& v2)
@@ -20,21 +233,17 @@ Triangle::Triangle(const Point3f& v0, const Point3f& v1, const Point3f& v2)
     e2 = v2 - v0;
 }
 
-bool Triangle::Hit(const Ray& ray, Float tMin, Float tMax, HitRecord& hitRecord) const
+bool Triangle::Intersect(const Ray& ray, Float tMin, Float tMax, RayHit& hit) const
 {
     Float u{ 0.f }, v{ 0.f }, tNear{ -1 };
 
-    if (rayIntersectMT(ray, tNear, u, v))
+    if (IntersectMT(ray, v0, e1, e2, tNear, u, v))
     {
         if (tNear > tMin && tNear < tMax)
         {
-            Vector3f n = Normalize((1 - u - v) * n0 + u * n1 + v * n2);
-            hitRecord.SetFrontFace(ray, n);
-
-            hitRecord.t = tNear;
-            hitRecord.p = ray.origin + tNear * ray.dir;
-            hitRecord.material = material;
-            hitRecord.texCoord = (1 - u - v) * t0 + u * t1 + v * t2;
+            hit.t = tNear;
+            hit.u = u;
+            hit.v = v;
             return true;
         }
     }
@@ -42,81 +251,167 @@ bool Triangle::Hit(const Ray& ray, Float tMin, Float tMax, HitRecord& hitRecord)
     return false;
 }
 
-// Möller–Trumbore: Get barycentric coordinates
-bool Triangle::rayIntersectMT(const Ray& ray, float& tNear, float& u, float& v) const
+bool Triangle::Occluded(const Ray& ray, Float tMin, Float tMax) const
 {
-    Vector3f s1 = Cross(ray.dir, e2);
-    float    s1_dot_e1 = Dot(s1, e1);
+    Float u{ 0.f }, v{ 0.f }, tNear{ -1 };
 
-    // Parallel
-    if (abs(s1_dot_e1) < 0.001) return false;
+    return IntersectMT(ray, v0, e1, e2, tNear, u, v) && tNear > tMin && tNear < tMax;
+}
 
-    float inv = 1.f / s1_dot_e1;
+uint32_t Triangle::IntersectPacket(const RayPacket& packet, uint32_t activeMask,
+                                   Float tMin, Float tMax[], RayHit hits[]) const
+{
+    Float    tNear[RayPacket::MaxSize], u[RayPacket::MaxSize], v[RayPacket::MaxSize];
+    uint32_t hitMask =
+        IntersectPacketMT(packet, activeMask, tMin, tMax, v0, e1, e2, tNear, u, v);
+    for (int i = 0; i < packet.size; ++i)
+    {
+        if (!(hitMask & (1u << i))) continue;
 
-    // u
-    Vector3f s = ray.origin - v0;
-    u = Dot(s1, s) * inv;
-    if (u < 0 || u > 1) return false;
+        hits[i].t = tNear[i];
+        hits[i].u = u[i];
+        hits[i].v = v[i];
+        tMax[i] = tNear[i];
+    }
+    return hitMask;
+}
 
-    // v
-    Vector3f s2 = Cross(s, e1);
-    v = Dot(s2, ray.dir) * inv;
-    if (v < 0 || u + v > 1) return false;
+uint32_t Triangle::OccludedPacket(const RayPacket& packet, uint32_t activeMask,
+                                  Float tMin, const Float tMax[]) const
+{
+    Float tNear[RayPacket::MaxSize], u[RayPacket::MaxSize], v[RayPacket::MaxSize];
+    return IntersectPacketMT(packet, activeMask, tMin, tMax, v0, e1, e2, tNear, u, v);
+}
 
-    // t
-    tNear = Dot(s2, e2) * inv;
-    if (tNear < 0) return false;
+void Triangle::ComputeHitRecord(const Ray& ray, const RayHit& hit,
+                                HitRecord& hitRecord) const
+{
+    Float u = hit.u, v = hit.v;
 
-    return true;
+    Vector3f n = Normalize((1 - u - v) * n0 + u * n1 + v * n2);
+    hitRecord.SetFrontFace(ray, n);
+
+    hitRecord.t = hit.t;
+    hitRecord.p = ray.origin + hit.t * ray.dir;
+    hitRecord.material = material.get();
+    hitRecord.texCoord = (1 - u - v) * t0 + u * t1 + v * t2;
+}
+
+void Triangle::SplitBound(const Bounds3& bounds, int axis, Float position, Bounds3& left,
+                          Bounds3& right) const
+{
+    const Point3f vertices[3] = { v0, v1, v2 };
+    SplitTriangleBound(vertices, bounds, axis, position, left, right);
 }
 
 /////////////////////////////////////////////////////////////////////////////////
 
 // Constructor
 MeshTriangle::MeshTriangle(const std::string& meshName)
-    : m_MeshName(meshName), m_Triangles(), m_Bvh(nullptr)
+    : m_MeshName(meshName),
+      m_Positions(),
+      m_Normals(),
+      m_TexCoords(),
+      m_VertexIndices(),
+      m_MaterialIds(),
+      m_Materials(),
+      m_Bvh(nullptr)
 {
 }
 
-void MeshTriangle::ApplyMaterial(const std::shared_ptr<Material>& material)
+int MeshTriangle::AddVertex(const Point3f& position, const Vector3f& normal,
+                            const Vector2f& texCoord)
+{
+    m_Positions.push_back(position);
+    m_Normals.push_back(normal);
+    m_TexCoords.push_back(texCoord);
+    return static_cast<int>(m_Positions.size()) - 1;
+}
+
+void MeshTriangle::AddTriangle(int v0, int v1, int v2,
+                               const std::shared_ptr<Material>& material)
 {
-    for (auto& triangle : m_Triangles)
+    // Faces come in runs of the same material, so look from the back
+    auto it = std::find(m_Materials.rbegin(), m_Materials.rend(), material);
+    int  materialId = static_cast<int>(m_Materials.rend() - it) - 1;
+    if (it == m_Materials.rend())
     {
-        triangle->material = material;
+        CHECK_LT(m_Materials.size(), 65536u);
+        materialId = static_cast<int>(m_Materials.size());
+        m_Materials.push_back(material);
     }
+
+    m_VertexIndices.push_back(v0);
+    m_VertexIndices.push_back(v1);
+    m_VertexIndices.push_back(v2);
+    m_MaterialIds.push_back(static_cast<uint16_t>(materialId));
 }
 
-void MeshTriangle::BuildBVH()
+void MeshTriangle::ApplyMaterial(const std::shared_ptr<Material>& material)
+{
+    m_Materials.assign(1, material);
+    std::fill(m_MaterialIds.begin(), m_MaterialIds.end(), 0);
+}
+
+void MeshTriangle::BuildBVH(const BVHBuildOptions& options)
 {
     spdlog::info("[MeshTriangle <{}>] Building BVH...", m_MeshName);
-    m_Bvh = std::make_shared<BVHAccel>(*this);
+    m_Bvh = std::make_shared<BVHAccel>(*this, options);
 }
 
-bool MeshTriangle::Hit(const Ray& ray, Float tMin, Float tMax, HitRecord& hitRecord) const
+bool MeshTriangle::Intersect(const Ray& ray, Float tMin, Float tMax, RayHit& hit) const
 {
     if (m_Bvh)
     {
-        return m_Bvh->Hit(ray, tMin, tMax, hitRecord);
+        return m_Bvh->Intersect(ray, tMin, tMax, hit);
     }
-    else
-    {
-        HitRecord tempRecord;
-        bool      hitAnything = false;
 
-        Float closestSoFar = tMax;
+    bool  hitAnything = false;
+    Float u, v, tNear;
 
-        for (const auto& object : m_Triangles)
+    for (int i = 0; i < NumTriangles(); ++i)
+    {
+        if (intersect(i, ray, tNear, u, v) && tNear > tMin && tNear < tMax)
         {
-            if (object->Hit(ray, tMin, closestSoFar, tempRecord))
-            {
-                hitAnything = true;
-                closestSoFar = tempRecord.t;
-                hitRecord = tempRecord;
-            }
+            hitAnything = true;
+            tMax = tNear;
+            hit.t = tNear;
+            hit.u = u;
+            hit.v = v;
+            hit.primitive = i;
         }
+    }
 
-        return hitAnything;
+    return hitAnything;
+}
+
+uint32_t MeshTriangle::IntersectPacket(const RayPacket& packet, uint32_t activeMask,
+                                       Float tMin, Float tMax[], RayHit hits[]) const
+{
+    if (m_Bvh) return m_Bvh->IntersectPacket(packet, activeMask, tMin, tMax, hits);
+    return Hittable::IntersectPacket(packet, activeMask, tMin, tMax, hits);
+}
+
+uint32_t MeshTriangle::OccludedPacket(const RayPacket& packet, uint32_t activeMask,
+                                      Float tMin, const Float tMax[]) const
+{
+    if (m_Bvh) return m_Bvh->OccludedPacket(packet, activeMask, tMin, tMax);
+    return Hittable::OccludedPacket(packet, activeMask, tMin, tMax);
+}
+
+bool MeshTriangle::Occluded(const Ray& ray, Float tMin, Float tMax) const
+{
+    if (m_Bvh)
+    {
+        return m_Bvh->Occluded(ray, tMin, tMax);
+    }
+
+    Float u, v, tNear;
+    for (int i = 0; i < NumTriangles(); ++i)
+    {
+        if (intersect(i, ray, tNear, u, v) && tNear > tMin && tNear < tMax) return true;
     }
+    return false;
 }
 
 void MeshTriangle::ApplyTransform(const Vector3f& translate, const Vector3f& rotate, Float scale)
@@ -127,20 +422,307 @@ void MeshTriangle::ApplyTransform(const Vector3f& translate, const Vector3f& rot
         scale = 1.f;
     }
 
-    for (auto& triangle : m_Triangles)
+    // Shared vertices are moved once instead of once per triangle
+    for (Point3f& position : m_Positions)
     {
-        triangle->ApplyTransform(translate, rotate, scale);
+        position = Transform(position, translate, rotate, scale);
+    }
+    for (Vector3f& normal : m_Normals)
+    {
+        normal = Normalize(TransformNormal(normal, rotate));
+    }
+
+    // Keep a built BVH in sync with the moved triangles
+    if (m_Bvh)
+    {
+        m_Bvh->Refit();
     }
 }
 
-Bounds3 MeshTriangle::WorldBound() const  // expensive
+Bounds3 MeshTriangle::WorldBound() const
 {
     Bounds3 worldBound(Point3f(0.f));
 
-    for (const auto& object : m_Triangles)
+    // The root of a built (or refit) BVH bounds the same triangles
+    if (m_Bvh) return Union(worldBound, m_Bvh->WorldBound());
+
+    for (int i = 0; i < NumTriangles(); ++i)
     {
-        worldBound = Union(worldBound, object->WorldBound());
+        worldBound = Union(worldBound, PrimitiveBound(i));
     }
 
     return worldBound;
-}
\ No newline at end of file
+}
+
+Bounds3 MeshTriangle::PrimitiveBound(int index) const
+{
+    Point3f p0, p1, p2;
+    GetPositions(index, p0, p1, p2);
+    return Union(Bounds3(p0, p1), p2);
+}
+
+void MeshTriangle::SplitPrimitiveBound(int index, const Bounds3& bounds, int axis,
+                                       Float position, Bounds3& left,
+                                       Bounds3& right) const
+{
+    Point3f vertices[3];
+    GetPositions(index, vertices[0], vertices[1], vertices[2]);
+    SplitTriangleBound(vertices, bounds, axis, position, left, right);
+}
+
+bool MeshTriangle::IntersectPrimitives(const int32_t* indices, int count, const Ray& ray,
+                                       Float tMin, Float tMax, RayHit& hit) const
+{
+    bool  hitAnything = false;
+    Float u, v, tNear;
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (intersect(indices[i], ray, tNear, u, v) && tNear > tMin && tNear < tMax)
+        {
+            hitAnything = true;
+            tMax = tNear;
+            hit.t = tNear;
+            hit.u = u;
+            hit.v = v;
+            hit.primitive = indices[i];
+        }
+    }
+
+    return hitAnything;
+}
+
+bool MeshTriangle::OccludedPrimitives(const int32_t* indices, int count, const Ray& ray,
+                                      Float tMin, Float tMax) const
+{
+    Float u, v, tNear;
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (intersect(indices[i], ray, tNear, u, v) && tNear > tMin && tNear < tMax)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t MeshTriangle::IntersectPrimitivesPacket(const int32_t* indices, int count,
+                                                 const RayPacket& packet,
+                                                 uint32_t activeMask, Float tMin,
+                                                 Float tMax[], RayHit hits[]) const
+{
+    Float tNear[RayPacket::MaxSize], u[RayPacket::MaxSize], v[RayPacket::MaxSize];
+
+    uint32_t hitMask = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        uint32_t mask =
+            intersectPacket(indices[i], packet, activeMask, tMin, tMax, tNear, u, v);
+        for (int j = 0; j < packet.size; ++j)
+        {
+            if (!(mask & (1u << j))) continue;
+
+            tMax[j] = tNear[j];
+            hits[j].t = tNear[j];
+            hits[j].u = u[j];
+            hits[j].v = v[j];
+            hits[j].primitive = indices[i];
+        }
+        hitMask |= mask;
+    }
+    return hitMask;
+}
+
+uint32_t MeshTriangle::OccludedPrimitivesPacket(const int32_t* indices, int count,
+                                                const RayPacket& packet,
+                                                uint32_t activeMask, Float tMin,
+                                                const Float tMax[]) const
+{
+    Float tNear[RayPacket::MaxSize], u[RayPacket::MaxSize], v[RayPacket::MaxSize];
+
+    uint32_t occludedMask = 0;
+    for (int i = 0; i < count && activeMask; ++i)
+    {
+        uint32_t occluded =
+            intersectPacket(indices[i], packet, activeMask, tMin, tMax, tNear, u, v);
+        occludedMask |= occluded;
+        activeMask &= ~occluded;
+    }
+    return occludedMask;
+}
+
+bool MeshTriangle::intersect(int triangle, const Ray& ray, Float& tNear, Float& u,
+                             Float& v) const
+{
+    Point3f p0, p1, p2;
+    GetPositions(triangle, p0, p1, p2);
+    return IntersectMT(ray, p0, p1 - p0, p2 - p0, tNear, u, v);
+}
+
+#ifdef FORKER_SIMD_SSE
+const int MeshTriangle::MaxBatchSize;
+
+// Nine streams of floats, v0.x, v0.y, v0.z, e1.x, ..., e2.z, with one entry per
+// index. Every stream is padded by MaxBatchSize entries, so that the lanes past the
+// last leaf can be loaded too.
+void MeshTriangle::PackLeaves(const std::vector<int32_t>& indices,
+                              std::vector<Float>&         packed) const
+{
+    int numIndices = static_cast<int>(indices.size());
+    int stride = numIndices + MaxBatchSize;
+    packed.assign(9 * stride, 0.f);
+
+    ParallelFor(0, numIndices, 4 * 1024, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i)
+        {
+            Point3f p0, p1, p2;
+            GetPositions(indices[i], p0, p1, p2);
+            Vector3f e1 = p1 - p0;
+            Vector3f e2 = p2 - p0;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                packed[axis * stride + i] = p0[axis];
+                packed[(3 + axis) * stride + i] = e1[axis];
+                packed[(6 + axis) * stride + i] = e2[axis];
+            }
+        }
+    });
+}
+
+bool MeshTriangle::IntersectPackedLeaf(const std::vector<Float>&   packed,
+                                       const std::vector<int32_t>& indices, int first,
+                                       int count, const Ray& ray, Float tMin, Float tMax,
+                                       RayHit& hit) const
+{
+    bool  hitAnything = false;
+    Float tNear[MaxBatchSize], u[MaxBatchSize], v[MaxBatchSize];
+
+    for (int begin = first; begin < first + count; begin += MaxBatchSize)
+    {
+        int      n = std::min(first + count - begin, MaxBatchSize);
+        uint32_t mask = intersectPacked(packed, begin, n, ray, tMin, tMax, tNear, u, v);
+
+        // In index order and strictly closer, like IntersectPrimitives()
+        for (int i = 0; i < n; ++i)
+        {
+            if (!(mask & (1u << i)) || !(tNear[i] < tMax)) continue;
+
+            hitAnything = true;
+            tMax = tNear[i];
+            hit.t = tNear[i];
+            hit.u = u[i];
+            hit.v = v[i];
+            hit.primitive = indices[begin + i];
+        }
+    }
+
+    return hitAnything;
+}
+
+bool MeshTriangle::OccludedPackedLeaf(const std::vector<Float>&   packed,
+                                      const std::vector<int32_t>& /*indices*/, int first,
+                                      int count, const Ray& ray, Float tMin,
+                                      Float tMax) const
+{
+    Float tNear[MaxBatchSize], u[MaxBatchSize], v[MaxBatchSize];
+
+    for (int begin = first; begin < first + count; begin += MaxBatchSize)
+    {
+        int n = std::min(first + count - begin, MaxBatchSize);
+        if (intersectPacked(packed, begin, n, ray, tMin, tMax, tNear, u, v)) return true;
+    }
+    return false;
+}
+
+uint32_t MeshTriangle::intersectPacked(const std::vector<Float>& packed, int first,
+                                       int count, const Ray& ray, Float tMin, Float tMax,
+                                       Float tNear[], Float u[], Float v[]) const
+{
+#ifdef FORKER_SIMD_AVX
+    if (count > 4)
+    {
+        return intersectPacked<8>(packed, first, count, ray, tMin, tMax, tNear, u, v);
+    }
+#endif
+    return intersectPacked<4>(packed, first, count, ray, tMin, tMax, tNear, u, v);
+}
+
+template <int N>
+uint32_t MeshTriangle::intersectPacked(const std::vector<Float>& packed, int first,
+                                       int count, const Ray& ray, Float tMin, Float tMax,
+                                       Float tNear[], Float u[], Float v[]) const
+{
+    int          stride = static_cast<int>(packed.size()) / 9;
+    const Float* p = &packed[first];
+
+    FloatN<N> batchT, batchU, batchV;
+    uint32_t  mask = IntersectMTN(ray, Vec3xN<N>::Load(p, p + stride, p + 2 * stride),
+                                  Vec3xN<N>::Load(p + 3 * stride, p + 4 * stride,
+                                                  p + 5 * stride),
+                                  Vec3xN<N>::Load(p + 6 * stride, p + 7 * stride,
+                                                  p + 8 * stride),
+                                  tMin, tMax, batchT, batchU, batchV);
+    batchT.Store(tNear);
+    batchU.Store(u);
+    batchV.Store(v);
+
+    // Lanes past count belong to the next leaf
+    return mask & ((1u << count) - 1);
+}
+#endif
+
+uint32_t MeshTriangle::intersectPacket(int triangle, const RayPacket& packet,
+                                       uint32_t activeMask, Float tMin,
+                                       const Float tMax[], Float tNear[], Float u[],
+                                       Float v[]) const
+{
+    Point3f p0, p1, p2;
+    GetPositions(triangle, p0, p1, p2);
+    return IntersectPacketMT(packet, activeMask, tMin, tMax, p0, p1 - p0, p2 - p0, tNear,
+                             u, v);
+}
+
+void MeshTriangle::ComputePrimitiveHitRecord(const Ray& ray, const RayHit& hit,
+                                             HitRecord& hitRecord) const
+{
+    const uint32_t* vi = &m_VertexIndices[3 * hit.primitive];
+    Float           u = hit.u, v = hit.v;
+
+    Vector3f n = Normalize((1 - u - v) * m_Normals[vi[0]] + u * m_Normals[vi[1]] +
+                           v * m_Normals[vi[2]]);
+    hitRecord.SetFrontFace(ray, n);
+
+    hitRecord.t = hit.t;
+    hitRecord.p = ray.origin + hit.t * ray.dir;
+    hitRecord.material = m_Materials[m_MaterialIds[hit.primitive]].get();
+    hitRecord.texCoord = (1 - u - v) * m_TexCoords[vi[0]] + u * m_TexCoords[vi[1]] +
+                         v * m_TexCoords[vi[2]];
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+void BuildBVHs(const std::vector<std::shared_ptr<MeshTriangle>>& meshTriangles,
+               const BVHBuildOptions& options)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    // Largest first, so that a big mesh does not start last and run alone
+    std::vector<std::shared_ptr<MeshTriangle>> meshes = meshTriangles;
+    std::stable_sort(meshes.begin(), meshes.end(),
+                     [](const std::shared_ptr<MeshTriangle>& a,
+                        const std::shared_ptr<MeshTriangle>& b) {
+                         return a->NumTriangles() > b->NumTriangles();
+                     });
+
+    TaskGroup group;
+    for (const std::shared_ptr<MeshTriangle>& mesh : meshes)
+    {
+        group.Run([&mesh, &options]() { mesh->BuildBVH(options); });
+    }
+    group.Wait();
+
+    std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+    spdlog::info("[MeshTriangle] Built {} mesh BVHs in {:.3f} secs", meshes.size(),
+                 diff.count());
+}
@@ -6,11 +6,14 @@
 #define SRC_CORE_TRIANGLE_H_
 
 #include <memory>
+#include <string>
+#include <vector>
 
+#include "bvh.h"
 #include "common.h"
 #include "hittable.h"
-
-class BVHAccel;
+#include "primitiveset.h"
+#include "simd.h"
 
 // Triangle Definitions
 class Triangle : public Hittable
@@ -19,10 +22,20 @@ public:
     // Constructors
     Triangle(const Point3f& v0, const Point3f& v1, const Point3f& v2);
 
-    bool Hit(const Ray& ray, Float tMin, Float tMax, HitRecord& hitRecord) const override;
+    bool Intersect(const Ray& ray, Float tMin, Float tMax, RayHit& hit) const override;
+    void ComputeHitRecord(const Ray& ray, const RayHit& hit,
+                          HitRecord& hitRecord) const override;
+    bool Occluded(const Ray& ray, Float tMin, Float tMax) const override;
+
+    uint32_t IntersectPacket(const RayPacket& packet, uint32_t activeMask, Float tMin,
+                             Float tMax[], RayHit hits[]) const override;
+    uint32_t OccludedPacket(const RayPacket& packet, uint32_t activeMask, Float tMin,
+                            const Float tMax[]) const override;
 
     // Inlines
     Bounds3 WorldBound() const override { return Union(Bounds3(v0, v1), v2); }
+    void    SplitBound(const Bounds3& bounds, int axis, Float position, Bounds3& left,
+                       Bounds3& right) const override;
 
     void SetNormals(const Vector3f& n0_, const Vector3f& n1_, const Vector3f& n2_)
     {
@@ -59,54 +72,135 @@ public:
     Vector2f                  t0, t1, t2;  // texture coords
     Vector3f                  n0, n1, n2;  // vertex normals
     std::shared_ptr<Material> material;
-
-private:
-    bool rayIntersectMT(const Ray& ray, float& tNear, float& u, float& v) const;
 };
 
 /////////////////////////////////////////////////////////////////////////////////
 
 // MeshTriangle Definitions
-class MeshTriangle : public Hittable
+// Indexed triangle mesh. Vertex positions, normals and texture coordinates live in
+// shared buffers; a triangle is three vertex indices and a material ID. The mesh BVH
+// refers to triangles by index (see PrimitiveSet), so unlike a Triangle they are not
+// objects of their own. RayHit::primitive is the index of the triangle that was hit.
+class MeshTriangle : public Hittable, public PrimitiveSet
 {
 public:
     // Constructor
     explicit MeshTriangle(const std::string& meshName);
 
-    int NumTriangles() const { return m_Triangles.size(); }
+    int NumTriangles() const { return static_cast<int>(m_MaterialIds.size()); }
+    int NumVertices() const { return static_cast<int>(m_Positions.size()); }
 
-    std::shared_ptr<Triangle> GetTriangle(int index) const { return m_Triangles[index]; }
+    std::string MeshName() const { return m_MeshName; }
 
-    std::vector<std::shared_ptr<Hittable>> GetTriangles() const
-    {
-        std::vector<std::shared_ptr<Hittable>> hittables;
-        for (const auto& tri : m_Triangles)
-        {
-            hittables.push_back(tri);
-        }
-        return hittables;
-    }
+    // Returns the index of the new vertex
+    int AddVertex(const Point3f& position, const Vector3f& normal,
+                  const Vector2f& texCoord);
 
-    std::string MeshName() const { return m_MeshName; }
+    void AddTriangle(int v0, int v1, int v2, const std::shared_ptr<Material>& material);
 
-    void AddTriangle(const std::shared_ptr<Triangle>& triangle)
+    void GetPositions(int triangle, Point3f& p0, Point3f& p1, Point3f& p2) const
     {
-        m_Triangles.push_back(triangle);
+        const uint32_t* v = &m_VertexIndices[3 * triangle];
+        p0 = m_Positions[v[0]];
+        p1 = m_Positions[v[1]];
+        p2 = m_Positions[v[2]];
     }
 
     void ApplyMaterial(const std::shared_ptr<Material>& material);
 
-    void BuildBVH();
+    void BuildBVH(const BVHBuildOptions& options = BVHBuildOptions());
 
-    bool Hit(const Ray& ray, Float tMin, Float tMax, HitRecord& hitRecord) const override;
+    bool Intersect(const Ray& ray, Float tMin, Float tMax, RayHit& hit) const override;
+    void ComputeHitRecord(const Ray& ray, const RayHit& hit,
+                          HitRecord& hitRecord) const override
+    {
+        ComputePrimitiveHitRecord(ray, hit, hitRecord);
+    }
+    bool Occluded(const Ray& ray, Float tMin, Float tMax) const override;
+    uint32_t IntersectPacket(const RayPacket& packet, uint32_t activeMask, Float tMin,
+                             Float tMax[], RayHit hits[]) const override;
+    uint32_t OccludedPacket(const RayPacket& packet, uint32_t activeMask, Float tMin,
+                            const Float tMax[]) const override;
     void ApplyTransform(const Vector3f &translate, const Vector3f& rotate, Float scale) override;
 
     Bounds3 WorldBound() const override;
 
+    // Primitive Set (the triangles)
+    int     NumPrimitives() const override { return NumTriangles(); }
+    Bounds3 PrimitiveBound(int index) const override;
+    void    SplitPrimitiveBound(int index, const Bounds3& bounds, int axis, Float position,
+                                Bounds3& left, Bounds3& right) const override;
+
+    bool IntersectPrimitives(const int32_t* indices, int count, const Ray& ray,
+                             Float tMin, Float tMax, RayHit& hit) const override;
+    bool OccludedPrimitives(const int32_t* indices, int count, const Ray& ray, Float tMin,
+                            Float tMax) const override;
+    void ComputePrimitiveHitRecord(const Ray& ray, const RayHit& hit,
+                                   HitRecord& hitRecord) const override;
+    uint32_t IntersectPrimitivesPacket(const int32_t* indices, int count,
+                                       const RayPacket& packet, uint32_t activeMask,
+                                       Float tMin, Float tMax[],
+                                       RayHit hits[]) const override;
+    uint32_t OccludedPrimitivesPacket(const int32_t* indices, int count,
+                                      const RayPacket& packet, uint32_t activeMask,
+                                      Float tMin, const Float tMax[]) const override;
+
+#ifdef FORKER_SIMD_SSE
+    // Packed leaves hold v0, e1 and e2 of the triangles in SoA, and a leaf is tested
+    // against the ray up to MaxBatchSize triangles at a time
+    void PackLeaves(const std::vector<int32_t>& indices,
+                    std::vector<Float>&         packed) const override;
+    bool IntersectPackedLeaf(const std::vector<Float>&   packed,
+                             const std::vector<int32_t>& indices, int first, int count,
+                             const Ray& ray, Float tMin, Float tMax,
+                             RayHit& hit) const override;
+    bool OccludedPackedLeaf(const std::vector<Float>&   packed,
+                            const std::vector<int32_t>& indices, int first, int count,
+                            const Ray& ray, Float tMin, Float tMax) const override;
+#endif
+
 private:
+#ifdef FORKER_SIMD_SSE
+    // Triangles per pass: 8 with AVX, 4 with SSE
+#ifdef FORKER_SIMD_AVX
+    static const int MaxBatchSize = 8;
+#else
+    static const int MaxBatchSize = 4;
+#endif
+
+    // Tests the packed triangles [first, first + count), count <= MaxBatchSize,
+    // against the ray in one pass. Returns the mask of the ones hit within
+    // (tMin, tMax).
+    uint32_t intersectPacked(const std::vector<Float>& packed, int first, int count,
+                             const Ray& ray, Float tMin, Float tMax, Float tNear[],
+                             Float u[], Float v[]) const;
+    template <int N>
+    uint32_t intersectPacked(const std::vector<Float>& packed, int first, int count,
+                             const Ray& ray, Float tMin, Float tMax, Float tNear[],
+                             Float u[], Float v[]) const;
+#endif
+
+    bool     intersect(int triangle, const Ray& ray, Float& tNear, Float& u,
+                       Float& v) const;
+    uint32_t intersectPacket(int triangle, const RayPacket& packet, uint32_t activeMask,
+                             Float tMin, const Float tMax[], Float tNear[], Float u[],
+                             Float v[]) const;
+
+    // Private Data
     std::string                            m_MeshName;
-    std::vector<std::shared_ptr<Triangle>> m_Triangles;
+    std::vector<Point3f>                   m_Positions;
+    std::vector<Vector3f>                  m_Normals;        // per vertex
+    std::vector<Vector2f>                  m_TexCoords;      // per vertex
+    std::vector<uint32_t>                  m_VertexIndices;  // 3 per triangle
+    std::vector<uint16_t>                  m_MaterialIds;    // per triangle
+    std::vector<std::shared_ptr<Material>> m_Materials;      // by material ID
     std::shared_ptr<BVHAccel>              m_Bvh;
 };
 
+// Builds the BVHs of independent meshes (e.g. the groups of an OBJ file) as
+// concurrent tasks on the global thread pool and returns once all are done. Every
+// build still splits its own work across the pool.
+void BuildBVHs(const std::vector<std::shared_ptr<MeshTriangle>>& meshTriangles,
+               const BVHBuildOptions& options = BVHBuildOptions());
+
 #endif  // SRC_CORE_TRIANGLE_H_
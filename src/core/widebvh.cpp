@@ -0,0 +1,610 @@
+//
+// Created by Junhao Wang (@Forkercat) on 2021/5/24.
+//
+
+#include "widebvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "nodelayout.h"
+#include "simd.h"
+
+namespace
+{
+// Ray data shared by all slab tests of a traversal
+struct WideRay
+{
+    explicit WideRay(const Ray& ray)
+    {
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            origin[axis] = ray.origin[axis];
+            invDir[axis] = ray.invDir[axis];
+            dirIsNeg[axis] = ray.invDir[axis] < 0;  // also right for -0 directions
+        }
+    }
+
+    Float origin[3];
+    Float invDir[3];
+    int   dirIsNeg[3];
+};
+
+// Entry of the traversal stack: a node, or a leaf range if numPrimitives > 0
+struct StackEntry
+{
+    int32_t offset;
+    int32_t numPrimitives;
+    Float   tEnter;
+};
+
+// Slab test against all children of a node. Returns a bit mask of the children
+// hit within [tMin, tMax] and their entry distances.
+template <int N>
+inline int IntersectChildren(const WideBVHNode<N>& node, const WideRay& ray, Float tMin,
+                             Float tMax, Float tEnter[N])
+{
+    int mask = 0;
+    for (int i = 0; i < node.numChildren; ++i)
+    {
+        Float tNear = tMin;
+        Float tFar = tMax;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            Float t0 = (node.bounds[ray.dirIsNeg[axis]][axis][i] - ray.origin[axis]) *
+                       ray.invDir[axis];
+            Float t1 = (node.bounds[1 - ray.dirIsNeg[axis]][axis][i] - ray.origin[axis]) *
+                       ray.invDir[axis];
+            tNear = t0 > tNear ? t0 : tNear;
+            tFar = t1 < tFar ? t1 : tFar;
+        }
+        tEnter[i] = tNear;
+        mask |= (tNear <= tFar) << i;
+    }
+    return mask;
+}
+
+// Requests all cache lines of a node that is about to be visited, so that the
+// misses overlap with the work on its siblings
+template <typename Node>
+inline void PrefetchNode(const Node* node)
+{
+    const char* bytes = reinterpret_cast<const char*>(node);
+    for (size_t line = 0; line < sizeof(Node); line += FORKER_CACHE_LINE_SIZE)
+    {
+        FORKER_PREFETCH(bytes + line);
+    }
+}
+
+// Grid spacing of a quantized node, 2^exponent
+inline Float Pow2(int exponent)
+{
+#ifdef FLOAT_AS_DOUBLE
+    return std::ldexp(1.0, exponent);
+#else
+    uint32_t bits = static_cast<uint32_t>(exponent + 127) << 23;
+    float    f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+#endif
+}
+
+// q * 2^exponent is exact, so this gives the same result whether or not the
+// compiler contracts it into an FMA
+inline Float Dequantize(Float origin, uint8_t q, Float scale)
+{
+    return origin + static_cast<Float>(q) * scale;
+}
+
+template <int N>
+inline int IntersectChildren(const QuantizedWideBVHNode<N>& node, const WideRay& ray,
+                             Float tMin, Float tMax, Float tEnter[N])
+{
+    Float scale[3];
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        scale[axis] = Pow2(node.exponent[axis]);
+    }
+
+    int mask = 0;
+    for (int i = 0; i < node.numChildren; ++i)
+    {
+        Float tNear = tMin;
+        Float tFar = tMax;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            uint8_t qNear = node.bounds[ray.dirIsNeg[axis]][axis][i];
+            uint8_t qFar = node.bounds[1 - ray.dirIsNeg[axis]][axis][i];
+            Float   nearPlane = Dequantize(node.origin[axis], qNear, scale[axis]);
+            Float   farPlane = Dequantize(node.origin[axis], qFar, scale[axis]);
+            Float t0 = (nearPlane - ray.origin[axis]) * ray.invDir[axis];
+            Float t1 = (farPlane - ray.origin[axis]) * ray.invDir[axis];
+            tNear = t0 > tNear ? t0 : tNear;
+            tFar = t1 < tFar ? t1 : tFar;
+        }
+        tEnter[i] = tNear;
+        mask |= (tNear <= tFar) << i;
+    }
+    return mask;
+}
+
+#ifdef FORKER_SIMD_SSE
+// Four 8-bit grid coordinates to origin + q * scale
+inline __m128 Dequantize4(const uint8_t* q, __m128 origin, __m128 scale)
+{
+    int32_t packed;
+    std::memcpy(&packed, q, sizeof(packed));
+
+    __m128i zero = _mm_setzero_si128();
+    __m128i bytes = _mm_cvtsi32_si128(packed);
+    __m128i ints = _mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero);
+    return _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(ints), scale));
+}
+
+template <>
+inline int IntersectChildren<4>(const WideBVHNode<4>& node, const WideRay& ray,
+                                Float tMin, Float tMax, Float tEnter[4])
+{
+    __m128 tNear = _mm_set1_ps(tMin);
+    __m128 tFar = _mm_set1_ps(tMax);
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        __m128 origin = _mm_set1_ps(ray.origin[axis]);
+        __m128 invDir = _mm_set1_ps(ray.invDir[axis]);
+        __m128 nearPlane = _mm_loadu_ps(node.bounds[ray.dirIsNeg[axis]][axis]);
+        __m128 farPlane = _mm_loadu_ps(node.bounds[1 - ray.dirIsNeg[axis]][axis]);
+
+        // NaNs (0 * inf) keep the running value, like the scalar version
+        tNear = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearPlane, origin), invDir), tNear);
+        tFar = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(farPlane, origin), invDir), tFar);
+    }
+    _mm_storeu_ps(tEnter, tNear);
+
+    int valid = (1 << node.numChildren) - 1;
+    return _mm_movemask_ps(_mm_cmple_ps(tNear, tFar)) & valid;
+}
+
+// Slab test against the quantized children [first, first + 4), unmasked
+template <int N>
+inline int IntersectQuantized4(const QuantizedWideBVHNode<N>& node, int first,
+                               const WideRay& ray, Float tMin, Float tMax,
+                               Float tEnter[N])
+{
+    __m128 tNear = _mm_set1_ps(tMin);
+    __m128 tFar = _mm_set1_ps(tMax);
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        __m128 nodeOrigin = _mm_set1_ps(node.origin[axis]);
+        __m128 scale = _mm_set1_ps(Pow2(node.exponent[axis]));
+        __m128 origin = _mm_set1_ps(ray.origin[axis]);
+        __m128 invDir = _mm_set1_ps(ray.invDir[axis]);
+        const uint8_t* nearBounds = node.bounds[ray.dirIsNeg[axis]][axis] + first;
+        const uint8_t* farBounds = node.bounds[1 - ray.dirIsNeg[axis]][axis] + first;
+        __m128         nearPlane = Dequantize4(nearBounds, nodeOrigin, scale);
+        __m128         farPlane = Dequantize4(farBounds, nodeOrigin, scale);
+
+        tNear = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearPlane, origin), invDir), tNear);
+        tFar = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(farPlane, origin), invDir), tFar);
+    }
+    _mm_storeu_ps(tEnter + first, tNear);
+
+    return _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+}
+
+template <>
+inline int IntersectChildren<4>(const QuantizedWideBVHNode<4>& node, const WideRay& ray,
+                                Float tMin, Float tMax, Float tEnter[4])
+{
+    int valid = (1 << node.numChildren) - 1;
+    return IntersectQuantized4(node, 0, ray, tMin, tMax, tEnter) & valid;
+}
+
+#ifndef FORKER_SIMD_AVX
+// Two 4-wide halves without AVX
+template <>
+inline int IntersectChildren<8>(const QuantizedWideBVHNode<8>& node, const WideRay& ray,
+                                Float tMin, Float tMax, Float tEnter[8])
+{
+    int mask = IntersectQuantized4(node, 0, ray, tMin, tMax, tEnter);
+    if (node.numChildren > 4)
+        mask |= IntersectQuantized4(node, 4, ray, tMin, tMax, tEnter) << 4;
+
+    int valid = (1 << node.numChildren) - 1;
+    return mask & valid;
+}
+#endif
+#endif
+
+#ifdef FORKER_SIMD_AVX
+template <>
+inline int IntersectChildren<8>(const WideBVHNode<8>& node, const WideRay& ray,
+                                Float tMin, Float tMax, Float tEnter[8])
+{
+    __m256 tNear = _mm256_set1_ps(tMin);
+    __m256 tFar = _mm256_set1_ps(tMax);
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        __m256 origin = _mm256_set1_ps(ray.origin[axis]);
+        __m256 invDir = _mm256_set1_ps(ray.invDir[axis]);
+        __m256 nearPlane = _mm256_loadu_ps(node.bounds[ray.dirIsNeg[axis]][axis]);
+        __m256 farPlane = _mm256_loadu_ps(node.bounds[1 - ray.dirIsNeg[axis]][axis]);
+
+        tNear = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(nearPlane, origin), invDir),
+                              tNear);
+        tFar = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(farPlane, origin), invDir), tFar);
+    }
+    _mm256_storeu_ps(tEnter, tNear);
+
+    int valid = (1 << node.numChildren) - 1;
+    return _mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ)) & valid;
+}
+
+template <>
+inline int IntersectChildren<8>(const QuantizedWideBVHNode<8>& node, const WideRay& ray,
+                                Float tMin, Float tMax, Float tEnter[8])
+{
+    __m256 tNear = _mm256_set1_ps(tMin);
+    __m256 tFar = _mm256_set1_ps(tMax);
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        __m128 nodeOrigin = _mm_set1_ps(node.origin[axis]);
+        __m128 scale = _mm_set1_ps(Pow2(node.exponent[axis]));
+        __m256 origin = _mm256_set1_ps(ray.origin[axis]);
+        __m256 invDir = _mm256_set1_ps(ray.invDir[axis]);
+
+        const uint8_t* nearBounds = node.bounds[ray.dirIsNeg[axis]][axis];
+        const uint8_t* farBounds = node.bounds[1 - ray.dirIsNeg[axis]][axis];
+        __m256 nearPlane = _mm256_insertf128_ps(
+            _mm256_castps128_ps256(Dequantize4(nearBounds, nodeOrigin, scale)),
+            Dequantize4(nearBounds + 4, nodeOrigin, scale), 1);
+        __m256 farPlane = _mm256_insertf128_ps(
+            _mm256_castps128_ps256(Dequantize4(farBounds, nodeOrigin, scale)),
+            Dequantize4(farBounds + 4, nodeOrigin, scale), 1);
+
+        tNear = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(nearPlane, origin), invDir),
+                              tNear);
+        tFar =
+            _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(farPlane, origin), invDir), tFar);
+    }
+    _mm256_storeu_ps(tEnter, tNear);
+
+    int valid = (1 << node.numChildren) - 1;
+    return _mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ)) & valid;
+}
+#endif
+}  // namespace
+
+// Constructor
+template <int N>
+WideBVH<N>::WideBVH(const std::vector<LinearBVHNode>& binaryNodes, bool quantized)
+    : m_Quantized(quantized), m_Nodes(), m_QuantizedNodes()
+{
+    if (binaryNodes.empty()) return;
+
+    m_Nodes.reserve(binaryNodes.size() / (N - 1) + 1);
+    collapse(binaryNodes, 0);
+    layout();
+
+    if (m_Quantized)
+    {
+        m_QuantizedNodes.reserve(m_Nodes.size());
+        for (const WideBVHNode<N>& node : m_Nodes)
+        {
+            m_QuantizedNodes.push_back(quantize(node));
+        }
+        std::vector<WideBVHNode<N>>().swap(m_Nodes);
+    }
+}
+
+// Public Methods
+template <int N>
+bool WideBVH<N>::Intersect(const PrimitiveSet&         primitives,
+                           const std::vector<int32_t>& indices,
+                           const std::vector<Float>& packed, const Ray& ray, Float tMin,
+                           Float tMax, RayHit& hit) const
+{
+    return m_Quantized ? intersect(m_QuantizedNodes, primitives, indices, packed, ray,
+                                   tMin, tMax, hit)
+                       : intersect(m_Nodes, primitives, indices, packed, ray, tMin, tMax,
+                                   hit);
+}
+
+template <int N>
+bool WideBVH<N>::Occluded(const PrimitiveSet&         primitives,
+                          const std::vector<int32_t>& indices,
+                          const std::vector<Float>& packed, const Ray& ray, Float tMin,
+                          Float tMax) const
+{
+    return m_Quantized
+               ? occluded(m_QuantizedNodes, primitives, indices, packed, ray, tMin, tMax)
+               : occluded(m_Nodes, primitives, indices, packed, ray, tMin, tMax);
+}
+
+// Private Methods
+template <int N>
+template <typename Node>
+bool WideBVH<N>::intersect(const std::vector<Node>& nodes, const PrimitiveSet& primitives,
+                           const std::vector<int32_t>& indices,
+                           const std::vector<Float>& packed, const Ray& ray, Float tMin,
+                           Float tMax, RayHit& hit) const
+{
+    if (nodes.empty()) return false;
+
+    WideRay wideRay(ray);
+    bool    hitAnything = false;
+
+    StackEntry toVisit[StackSize];
+    int        toVisitOffset = 0;
+    toVisit[toVisitOffset++] = { 0, 0, tMin };
+
+    while (toVisitOffset > 0)
+    {
+        const StackEntry entry = toVisit[--toVisitOffset];
+
+        // A closer hit may have been found since the entry was pushed
+        if (entry.tEnter > tMax) continue;
+
+        if (entry.numPrimitives > 0)
+        {
+            if (primitives.IntersectLeaf(packed, indices, entry.offset,
+                                         entry.numPrimitives, ray, tMin, tMax, hit))
+            {
+                hitAnything = true;
+                tMax = hit.t;
+            }
+            continue;
+        }
+
+        const Node& node = nodes[entry.offset];
+
+        Float tEnter[N];
+        int   mask = IntersectChildren<N>(node, wideRay, tMin, tMax, tEnter);
+        if (mask == 0) continue;
+
+        // Push the hit children far to near, so the nearest one is popped first
+        int begin = toVisitOffset;
+        for (int i = 0; i < N; ++i)
+        {
+            if (!(mask & (1 << i))) continue;
+
+            StackEntry child = { node.offset[i], node.numPrimitives[i], tEnter[i] };
+            if (child.numPrimitives > 0)
+                FORKER_PREFETCH(&indices[child.offset]);
+            else
+                PrefetchNode(&nodes[child.offset]);
+
+            int j = toVisitOffset++;
+            for (; j > begin && toVisit[j - 1].tEnter < child.tEnter; --j)
+            {
+                toVisit[j] = toVisit[j - 1];
+            }
+            toVisit[j] = child;
+        }
+    }
+
+    return hitAnything;
+}
+
+template <int N>
+template <typename Node>
+bool WideBVH<N>::occluded(const std::vector<Node>& nodes, const PrimitiveSet& primitives,
+                          const std::vector<int32_t>& indices,
+                          const std::vector<Float>& packed, const Ray& ray, Float tMin,
+                          Float tMax) const
+{
+    if (nodes.empty()) return false;
+
+    WideRay wideRay(ray);
+
+    int toVisit[StackSize];
+    int toVisitOffset = 0;
+    toVisit[toVisitOffset++] = 0;
+
+    while (toVisitOffset > 0)
+    {
+        const Node& node = nodes[toVisit[--toVisitOffset]];
+
+        Float tEnter[N];
+        int   mask = IntersectChildren<N>(node, wideRay, tMin, tMax, tEnter);
+
+        // Any hit will do, so test leaves right away and skip the sorting
+        for (int i = 0; i < N; ++i)
+        {
+            if (!(mask & (1 << i))) continue;
+
+            if (node.IsLeaf(i))
+            {
+                if (primitives.OccludedLeaf(packed, indices, node.offset[i],
+                                            node.numPrimitives[i], ray, tMin, tMax))
+                {
+                    return true;
+                }
+            }
+            else
+            {
+                PrefetchNode(&nodes[node.offset[i]]);
+                toVisit[toVisitOffset++] = node.offset[i];
+            }
+        }
+    }
+
+    return false;
+}
+
+// Writes the wide node rooted at binary node nodeIndex and returns its index
+template <int N>
+int WideBVH<N>::collapse(const std::vector<LinearBVHNode>& binaryNodes, int nodeIndex)
+{
+    const LinearBVHNode& root = binaryNodes[nodeIndex];
+
+    int children[N];
+    int numChildren = 0;
+    if (root.IsLeaf())
+    {
+        children[numChildren++] = nodeIndex;
+    }
+    else
+    {
+        children[numChildren++] = root.childOffset;
+        children[numChildren++] = root.childOffset + 1;
+    }
+
+    // Open the interior child with the largest surface area until the node is full
+    while (numChildren < N)
+    {
+        int   largest = -1;
+        Float largestArea = -1.f;
+        for (int i = 0; i < numChildren; ++i)
+        {
+            const LinearBVHNode& child = binaryNodes[children[i]];
+            if (!child.IsLeaf() && child.bounds.SurfaceArea() > largestArea)
+            {
+                largest = i;
+                largestArea = child.bounds.SurfaceArea();
+            }
+        }
+
+        if (largest < 0) break;
+
+        int childOffset = binaryNodes[children[largest]].childOffset;
+        children[largest] = childOffset;
+        children[numChildren++] = childOffset + 1;
+    }
+
+    int wideIndex = static_cast<int>(m_Nodes.size());
+    m_Nodes.emplace_back();
+
+    // Empty slots get inverted bounds so that they can never be hit
+    WideBVHNode<N> wideNode;
+    wideNode.numChildren = static_cast<uint8_t>(numChildren);
+    for (int i = 0; i < N; ++i)
+    {
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            wideNode.bounds[0][axis][i] = Infinity;
+            wideNode.bounds[1][axis][i] = -Infinity;
+        }
+        wideNode.offset[i] = -1;
+        wideNode.numPrimitives[i] = 0;
+    }
+
+    for (int i = 0; i < numChildren; ++i)
+    {
+        const LinearBVHNode& child = binaryNodes[children[i]];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            wideNode.bounds[0][axis][i] = child.bounds.pMin[axis];
+            wideNode.bounds[1][axis][i] = child.bounds.pMax[axis];
+        }
+
+        if (child.IsLeaf())
+        {
+            wideNode.offset[i] = child.primitivesOffset;
+            wideNode.numPrimitives[i] = child.numPrimitives;
+        }
+        else
+        {
+            wideNode.offset[i] = collapse(binaryNodes, children[i]);
+        }
+    }
+
+    m_Nodes[wideIndex] = wideNode;
+    return wideIndex;
+}
+
+// Reorders m_Nodes into page-sized clusters (see ClusteredLayout)
+template <int N>
+void WideBVH<N>::layout()
+{
+    int numNodes = static_cast<int>(m_Nodes.size());
+    int clusterSize = Max(NodeClusterBytes / NodeSize(), 1);
+
+    std::vector<int> order =
+        ClusteredLayout(numNodes, clusterSize, [&](int node, std::vector<int>& children) {
+            for (int i = 0; i < m_Nodes[node].numChildren; ++i)
+            {
+                if (!m_Nodes[node].IsLeaf(i)) children.push_back(m_Nodes[node].offset[i]);
+            }
+        });
+
+    std::vector<int> newIndex(numNodes);
+    for (int i = 0; i < numNodes; ++i)
+    {
+        newIndex[order[i]] = i;
+    }
+
+    std::vector<WideBVHNode<N>> nodes(numNodes);
+    for (int i = 0; i < numNodes; ++i)
+    {
+        WideBVHNode<N> node = m_Nodes[i];
+        for (int c = 0; c < node.numChildren; ++c)
+        {
+            if (!node.IsLeaf(c)) node.offset[c] = newIndex[node.offset[c]];
+        }
+        nodes[newIndex[i]] = node;
+    }
+    m_Nodes.swap(nodes);
+}
+
+template <int N>
+QuantizedWideBVHNode<N> WideBVH<N>::quantize(const WideBVHNode<N>& node)
+{
+    QuantizedWideBVHNode<N> quantized;
+    std::memset(&quantized, 0, sizeof(quantized));  // unused slots stay 0, masked out
+    quantized.numChildren = node.numChildren;
+    for (int i = 0; i < N; ++i)
+    {
+        quantized.offset[i] = node.offset[i];
+        quantized.numPrimitives[i] = node.numPrimitives[i];
+    }
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        Float lo = Infinity;
+        Float hi = -Infinity;
+        for (int i = 0; i < node.numChildren; ++i)
+        {
+            lo = Min(lo, node.bounds[0][axis][i]);
+            hi = Max(hi, node.bounds[1][axis][i]);
+        }
+
+        // Smallest power of two that spans the node in 255 steps. Outward rounding
+        // may need one step more, in which case the next exponent is used.
+        int exponent;
+        std::frexp((hi - lo) / 255, &exponent);
+        exponent = Clamp(exponent, -100, 100);
+
+        for (bool fits = false; !fits; ++exponent)
+        {
+            Float scale = Pow2(exponent);
+            fits = true;
+            for (int i = 0; i < node.numChildren && fits; ++i)
+            {
+                Float childLo = node.bounds[0][axis][i];
+                Float childHi = node.bounds[1][axis][i];
+
+                int qLo = static_cast<int>(std::floor((childLo - lo) / scale));
+                qLo = Clamp(qLo, 0, 255);
+                while (qLo > 0 && Dequantize(lo, qLo, scale) > childLo) --qLo;
+
+                int qHi = static_cast<int>(std::ceil((childHi - lo) / scale));
+                qHi = Clamp(qHi, 0, 256);
+                while (qHi < 256 && Dequantize(lo, qHi, scale) < childHi) ++qHi;
+
+                fits = qHi <= 255;
+                quantized.bounds[0][axis][i] = static_cast<uint8_t>(qLo);
+                quantized.bounds[1][axis][i] = static_cast<uint8_t>(qHi);
+            }
+
+            quantized.origin[axis] = lo;
+            quantized.exponent[axis] = static_cast<int8_t>(exponent);
+        }
+    }
+
+    return quantized;
+}
+
+// Explicit Instantiations
+template class WideBVH<4>;
+template class WideBVH<8>;
@@ -0,0 +1,114 @@
+//
+// Created by Junhao Wang (@Forkercat) on 2021/5/24.
+//
+
+#ifndef SRC_CORE_WIDEBVH_H_
+#define SRC_CORE_WIDEBVH_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "bvh.h"
+
+// Wide BVH Node
+// Child bounds are stored in SoA layout, so one SIMD slab test covers all N
+// children. Leaf children are not nodes of their own: they point straight into
+// BVHAccel's primitive index array.
+template <int N>
+struct WideBVHNode
+{
+    Float    bounds[2][3][N];    // [min / max][axis][child]
+    int32_t  offset[N];          // interior: child node index, leaf: first primitive
+    uint16_t numPrimitives[N];   // 0 -> interior child
+    uint8_t  numChildren;
+
+    bool IsLeaf(int child) const { return numPrimitives[child] > 0; }
+};
+
+// Quantized Wide BVH Node
+// Child bounds are 8-bit coordinates on a grid local to the node: along each axis a
+// bound is origin + q * 2^exponent. Encoding rounds outwards, so the decoded box
+// always contains the child. 64 instead of 124 bytes for N = 4, 112 instead of 244
+// for N = 8.
+template <int N>
+struct QuantizedWideBVHNode
+{
+    Float    origin[3];          // min corner of the union of the children
+    int8_t   exponent[3];        // grid spacing per axis
+    uint8_t  numChildren;
+    uint8_t  bounds[2][3][N];    // [min / max][axis][child]
+    int32_t  offset[N];          // interior: child node index, leaf: first primitive
+    uint16_t numPrimitives[N];   // 0 -> interior child
+
+    bool IsLeaf(int child) const { return numPrimitives[child] > 0; }
+};
+
+#ifndef FLOAT_AS_DOUBLE
+static_assert(sizeof(QuantizedWideBVHNode<4>) == 64,
+              "Quantized BVH4 node should fill a cache line");
+#endif
+
+// Wide BVH (BVH4 / BVH8)
+// Built by collapsing a binary BVH: every node repeatedly opens its largest
+// interior child until it holds N children. Traversal visits hit children in
+// front-to-back order. Nodes are laid out in page-sized clusters, and quantized
+// trees keep only the compressed nodes.
+template <int N>
+class WideBVH
+{
+public:
+    static_assert(N == 4 || N == 8, "WideBVH supports 4 or 8 children per node");
+
+    // Constructor
+    explicit WideBVH(const std::vector<LinearBVHNode>& binaryNodes,
+                     bool                              quantized = false);
+
+    // Public Methods
+    // Leaves refer to the primitives through indices, and to packed if the set packed
+    // them (see PrimitiveSet::PackLeaves())
+    bool Intersect(const PrimitiveSet& primitives, const std::vector<int32_t>& indices,
+                   const std::vector<Float>& packed, const Ray& ray, Float tMin,
+                   Float tMax, RayHit& hit) const;
+    bool Occluded(const PrimitiveSet& primitives, const std::vector<int32_t>& indices,
+                  const std::vector<Float>& packed, const Ray& ray, Float tMin,
+                  Float tMax) const;
+
+    bool IsQuantized() const { return m_Quantized; }
+
+    int NumNodes() const
+    {
+        return static_cast<int>(m_Quantized ? m_QuantizedNodes.size() : m_Nodes.size());
+    }
+
+    int NodeSize() const
+    {
+        return m_Quantized ? sizeof(QuantizedWideBVHNode<N>) : sizeof(WideBVHNode<N>);
+    }
+
+    // Collapsing never deepens the tree, so every level pushes at most N - 1
+    // entries more than it pops
+    static const int StackSize = BVHAccel::MaxDepth * (N - 1) + 1;
+
+private:
+    template <typename Node>
+    bool intersect(const std::vector<Node>& nodes, const PrimitiveSet& primitives,
+                   const std::vector<int32_t>& indices, const std::vector<Float>& packed,
+                   const Ray& ray, Float tMin, Float tMax, RayHit& hit) const;
+    template <typename Node>
+    bool occluded(const std::vector<Node>& nodes, const PrimitiveSet& primitives,
+                  const std::vector<int32_t>& indices, const std::vector<Float>& packed,
+                  const Ray& ray, Float tMin, Float tMax) const;
+
+    int  collapse(const std::vector<LinearBVHNode>& binaryNodes, int nodeIndex);
+    void layout();
+
+    static QuantizedWideBVHNode<N> quantize(const WideBVHNode<N>& node);
+
+    // Private Data
+    bool                                 m_Quantized;
+    std::vector<WideBVHNode<N>>          m_Nodes;           // root at 0
+    std::vector<QuantizedWideBVHNode<N>> m_QuantizedNodes;  // same order as m_Nodes
+};
+
+#endif  // SRC_CORE_WIDEBVH_H_
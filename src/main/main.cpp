@@ -1,15 +1,15 @@
 #include <spdlog/spdlog.h>
 #include <spdlog/stopwatch.h>
 
+#include <cstdlib>
 #include <fstream>
-#include <future>
 #include <iostream>
-#include <thread>
+#include <string>
 
 #include "common.h"
 #include "core.h"
 
-#define NUM_THREADS 8
+#define TILE_SIZE 16
 
 Scene RandomScene(int num)
 {
@@ -85,16 +85,13 @@ inline void UpdateProgress(float progress)
     std::cout.flush();
 }
 
-Color3 CastRay(const Ray& ray, const Hittable& world, int depth)
-{
-    HitRecord hitRecord;
-
-    if (depth <= 0)
-    {
-        return Color3(0, 0, 0);
-    }
+Color3 CastRay(const Ray& ray, const Hittable& world, int depth);
 
-    if (world.Hit(ray, 0.001f, Infinity, hitRecord))
+// Radiance along a ray whose closest hit has been found already
+Color3 Shade(const Ray& ray, bool hit, const HitRecord& hitRecord, const Hittable& world,
+             int depth)
+{
+    if (hit)
     {
         Ray    rayScattered;
         Color3 emitted = hitRecord.material->Emit();
@@ -122,15 +119,32 @@ Color3 CastRay(const Ray& ray, const Hittable& world, int depth)
     return Color3(0.f);
 }
 
+Color3 CastRay(const Ray& ray, const Hittable& world, int depth)
+{
+    HitRecord hitRecord;
+
+    if (depth <= 0)
+    {
+        return Color3(0, 0, 0);
+    }
+
+    bool hit = world.Hit(ray, 0.001f, Infinity, hitRecord);
+    return Shade(ray, hit, hitRecord, world, depth);
+}
+
 struct SampleInfo
 {
     int x, y;
     int numSamples, maxDepth;
     int imageWidth, imageHeight;
+    uint64_t seed;
 };
 
 Color3 Sample(SampleInfo info, Camera& camera, Scene& scene)
 {
+    // One random sequence per pixel keeps the frame reproducible
+    SeedRandom(info.y * info.imageWidth + info.x, info.seed);
+
     Color3 color(0.f);
     for (int s = 0; s < info.numSamples; ++s)
     {
@@ -148,12 +162,178 @@ Color3 Sample(SampleInfo info, Camera& camera, Scene& scene)
     return color;
 }
 
-int main()
+// Samples a block of pixels, [x0, x1) x [y0, y1), tracing the camera rays of all
+// pixels as one packet per sample. Every pixel keeps its own random sequence, in the
+// same order as Sample() uses it, so the image does not change.
+void SampleBlock(SampleInfo info, int x0, int y0, int x1, int y1, Camera& camera,
+                 Scene& scene, Film& film)
+{
+    RNG    rngs[RayPacket::MaxSize];
+    Color3 colors[RayPacket::MaxSize];
+    int    numPixels = 0;
+    for (int y = y0; y < y1; ++y)
+    {
+        for (int x = x0; x < x1; ++x)
+        {
+            SeedRandom(y * info.imageWidth + x, info.seed);
+            rngs[numPixels] = ThreadRNG();
+            colors[numPixels++] = Color3(0.f);
+        }
+    }
+
+    for (int s = 0; s < info.numSamples && info.maxDepth > 0; ++s)
+    {
+        RayPacket packet;
+        Float     tMax[RayPacket::MaxSize];
+        for (int k = 0; k < numPixels; ++k)
+        {
+            ThreadRNG() = rngs[k];
+
+            Float xOffset = x0 + k % (x1 - x0) + Random01();
+            Float yOffset = y0 + k / (x1 - x0) + Random01();
+
+            // Map To [0, 1]
+            Float u = xOffset / (info.imageWidth - 1);
+            Float v = yOffset / (info.imageHeight - 1);
+
+            packet.Add(camera.GetRay(u, v));
+            tMax[k] = Infinity;
+            rngs[k] = ThreadRNG();
+        }
+
+        HitRecord hitRecords[RayPacket::MaxSize];
+        uint32_t  hitMask =
+            scene.HitPacket(packet, packet.FullMask(), 0.001f, tMax, hitRecords);
+
+        // Bounces are incoherent and go on one by one
+        for (int k = 0; k < numPixels; ++k)
+        {
+            ThreadRNG() = rngs[k];
+            bool hit = (hitMask >> k) & 1u;
+            colors[k] += Shade(packet.rays[k], hit, hitRecords[k], scene, info.maxDepth);
+            rngs[k] = ThreadRNG();
+        }
+    }
+
+    for (int k = 0; k < numPixels; ++k)
+    {
+        film.AddSample(x0 + k % (x1 - x0), y0 + k / (x1 - x0), colors[k]);
+    }
+}
+
+struct Options
+{
+    int             numThreads;
+    uint64_t        seed;
+    int             packetSize;  // camera rays per packet: 1 (no packets), 4, 8 or 16
+    BVHBuildOptions bvh;
+};
+
+// Usage: ForkerPathTracer [--threads N] [--seed S] [--packet 1|4|8|16]
+//                         [--bvh median|sah|sbvh|lbvh]
+//                         [--sah-bins N] [--leaf-size N] [--bvh-width 2|4|8]
+//                         [--bvh-nodes full|quantized] [--split-budget F]
+//                         [--bvh-optimize PASSES] [--bvh-cache DIR]
+// The thread count falls back to $FORKER_NUM_THREADS or the number of hardware threads.
+Options ParseOptions(int argc, char** argv)
+{
+    Options options;
+    options.numThreads = ThreadPool::DefaultNumThreads();
+    options.seed = 0;
+    options.packetSize = 16;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+
+        if ((arg == "--threads" || arg == "-t") && i + 1 < argc)
+        {
+            int numThreads = std::atoi(argv[++i]);
+            if (numThreads > 0)
+                options.numThreads = numThreads;
+            else
+                spdlog::warn("Invalid thread count: {}", argv[i]);
+        }
+        else if (arg == "--seed" && i + 1 < argc)
+        {
+            options.seed = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--packet" && i + 1 < argc)
+        {
+            int packetSize = std::atoi(argv[++i]);
+            if (packetSize == 1 || packetSize == 4 || packetSize == 8 || packetSize == 16)
+                options.packetSize = packetSize;
+            else
+                spdlog::warn("Invalid packet size: {}", argv[i]);
+        }
+        else if (arg == "--bvh" && i + 1 < argc)
+        {
+            std::string method = argv[++i];
+            if (method == "median")
+                options.bvh.splitMethod = BVHBuildOptions::Median;
+            else if (method == "sah")
+                options.bvh.splitMethod = BVHBuildOptions::SAH;
+            else if (method == "sbvh")
+                options.bvh.splitMethod = BVHBuildOptions::SBVH;
+            else if (method == "lbvh")
+                options.bvh.splitMethod = BVHBuildOptions::LBVH;
+            else
+                spdlog::warn("Unknown BVH split method: {}", method);
+        }
+        else if (arg == "--sah-bins" && i + 1 < argc)
+        {
+            options.bvh.numBins = Max(std::atoi(argv[++i]), 2);
+        }
+        else if (arg == "--leaf-size" && i + 1 < argc)
+        {
+            options.bvh.maxLeafSize = Max(std::atoi(argv[++i]), 1);
+        }
+        else if (arg == "--split-budget" && i + 1 < argc)
+        {
+            options.bvh.splitBudget = Max((Float)std::atof(argv[++i]), (Float)0);
+        }
+        else if (arg == "--bvh-width" && i + 1 < argc)
+        {
+            options.bvh.width = std::atoi(argv[++i]);
+        }
+        else if (arg == "--bvh-optimize" && i + 1 < argc)
+        {
+            options.bvh.optimizePasses = Max(std::atoi(argv[++i]), 0);
+        }
+        else if (arg == "--bvh-nodes" && i + 1 < argc)
+        {
+            std::string nodes = argv[++i];
+            if (nodes == "full")
+                options.bvh.quantized = false;
+            else if (nodes == "quantized")
+                options.bvh.quantized = true;
+            else
+                spdlog::warn("Unknown BVH node format: {}", nodes);
+        }
+        else if (arg == "--bvh-cache" && i + 1 < argc)
+        {
+            options.bvh.cacheDir = argv[++i];
+        }
+        else
+        {
+            spdlog::warn("Unknown option: {}", arg);
+        }
+    }
+
+    return options;
+}
+
+int main(int argc, char** argv)
 {
     // Spdlog
     spdlog::set_pattern("[%^%l%$] %v");
     spdlog::set_level(spdlog::level::debug);
 
+    // Threads
+    Options options = ParseOptions(argc, argv);
+    ThreadPool::Init(options.numThreads);
+    spdlog::info("#Threads: {}", ThreadPool::Global().NumThreads());
+
     // Image
     const Float aspectRatio = 16.f / 10.f;
     const int   imageWidth = 320;
@@ -183,13 +363,12 @@ int main()
         mesh->ApplyTransform(Vector3f(0.f, 0.f, 0.f), Vector3f(0, 180, 0), 1.5f);
         // mesh->ApplyTransform(Vector3f(0.f, 0.f, 0.f), 0.f);
 
-        // BVH
-        mesh->BuildBVH();
-
         scene.Add(mesh);
     }
 
-    scene.BuildBVH();
+    // Mesh BVHs build concurrently; the top level starts once all are done
+    BuildBVHs(meshTriangles, options.bvh);
+    scene.BuildBVH(options.bvh);
 
     if (!scene.SupportBVH())
     {
@@ -212,55 +391,55 @@ int main()
 
     // Render
     std::ofstream outfile("output/image.ppm");
-    outfile << "P3\n" << imageWidth << ' ' << imageHeight << "\n255\n";
 
     spdlog::stopwatch timer;
 
     // Configure Sample Info
     SampleInfo sampleInfo;
+    sampleInfo.numSamples = samplesPerPixel;
     sampleInfo.maxDepth = maxDepth;
     sampleInfo.imageWidth = imageWidth;
     sampleInfo.imageHeight = imageHeight;
+    sampleInfo.seed = options.seed;
 
-    assert(NUM_THREADS > 0);
-    spdlog::info("#Threads: {}", NUM_THREADS);
-
-    std::future<Color3> sampleColors[NUM_THREADS];
+    Film          film(imageWidth, imageHeight);
+    TileScheduler scheduler(imageWidth, imageHeight, TILE_SIZE);
 
-    for (int j = imageHeight - 1; j >= 0; --j)
-    {
-        for (int i = 0; i < imageWidth; ++i)
+    scheduler.Render(
+        ThreadPool::Global(),
+        [&](const Tile& tile)
         {
-            // Sending out multiple samples within a pixel
-
-            int numSamplesPerThread = (int) std::round(samplesPerPixel / (Float)NUM_THREADS);
-
-            // Update Sample Info
-            sampleInfo.x = i;
-            sampleInfo.y = j;
-
-            // Allocation
-            for (int tid = 0; tid < NUM_THREADS; ++tid)
+            SampleInfo info = sampleInfo;
+            if (options.packetSize > 1)
             {
-                sampleInfo.numSamples = numSamplesPerThread;
-                sampleColors[tid] =
-                    std::async(Sample, sampleInfo, std::ref(camera), std::ref(scene));
+                // Square-ish blocks: 2x2, 4x2 or 4x4 pixels
+                int blockWidth = options.packetSize >= 8 ? 4 : 2;
+                int blockHeight = options.packetSize / blockWidth;
+                for (int j = tile.y0; j < tile.y1; j += blockHeight)
+                {
+                    for (int i = tile.x0; i < tile.x1; i += blockWidth)
+                    {
+                        SampleBlock(info, i, j, Min(i + blockWidth, tile.x1),
+                                    Min(j + blockHeight, tile.y1), camera, scene, film);
+                    }
+                }
+                return;
             }
 
-            // Join
-            Color3 color(0.f);
-            for (int tid = 0; tid < NUM_THREADS; ++tid)
+            for (int j = tile.y0; j < tile.y1; ++j)
             {
-                color += sampleColors[tid].get();
+                for (int i = tile.x0; i < tile.x1; ++i)
+                {
+                    info.x = i;
+                    info.y = j;
+                    film.AddSample(i, j, Sample(info, camera, scene));
+                }
             }
+        },
+        UpdateProgress);
 
-            // Output
-            WriteColor(outfile, color, samplesPerPixel);
-        }
-
-        Float progress = (Float)(imageHeight - 1 - j) / (imageHeight - 1);
-        UpdateProgress(progress);
-    }
+    // Output
+    film.WritePPM(outfile, samplesPerPixel);
 
     spdlog::info("<Time Used: {:.6} Seconds>", timer);
 